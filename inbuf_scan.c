@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2013, 2015 Andreas Franz Borchert
+   Copyright (C) 2013, 2015, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -233,6 +233,7 @@ Andreas F. Borchert
 #include <stdlib.h>
 #include <stralloc.h>
 #include <afblib/inbuf_scan.h>
+#include <afblib/slab.h>
 
 struct pcre_handle;
 typedef int (*pcre_callout_function)(pcre_callout_block*);
@@ -243,6 +244,9 @@ struct callout_block_list {
    struct callout_block_list* next;
 };
 
+static slab_cache block_cache =
+   SLAB_CACHE_INITIALIZER("callout_block_list", struct callout_block_list);
+
 struct pcre_handle {
    inbuf* ibuf;
    stralloc input; /* input buffer, feeded from ibuf */
@@ -267,7 +271,7 @@ static void pcre_handle_free_block_list(struct pcre_handle* handle) {
    handle->head = 0; handle->tail = 0;
    while (p) {
       struct callout_block_list* old = p; p = p->next;
-      free(old);
+      slab_free(&block_cache, old);
    }
 }
 
@@ -484,8 +488,7 @@ static int pcre_callout_handler(pcre_callout_block* block) {
       but do not call the actual callout handler yet
       as this might be preliminary in case of a partial
       match */
-   struct callout_block_list* element =
-      malloc(sizeof(struct callout_block_list));
+   struct callout_block_list* element = slab_alloc(&block_cache);
    if (element == 0) return -1; /* abort it due to lack of memory */
    element->block = (inbuf_scan_callout_block) {
       .captured = captured,
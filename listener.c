@@ -0,0 +1,219 @@
+/*
+   Small library of useful utilities
+   Copyright (C) 2026 Andreas Franz Borchert
+   --------------------------------------------------------------------
+   This library is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+
+=head1 NAME
+
+create_listener -- create a socket which listens on a given hostport
+
+=head1 SYNOPSIS
+
+   #include <afblib/listener.h>
+
+   typedef struct socket_profile {
+      int backlog;
+      int rcvbuf, sndbuf;
+      bool reuseport;
+      bool v6only;
+      bool nodelay;
+      int defer_accept;
+      int fastopen;
+      int notsent_lowat;
+   } socket_profile;
+
+   int create_listener(hostport* hp, const socket_profile* profile);
+
+=head1 DESCRIPTION
+
+I<create_listener> creates a socket for the address specified by I<hp>
+(see L<hostport>), configures it according to I<profile>, binds it,
+and, unless it is a datagram or raw socket, lets it listen for
+connections. If no type has been set in I<hp>, I<SOCK_STREAM> is
+taken. Connection-oriented sockets like those of type I<SOCK_STREAM>
+or I<SOCK_SEQPACKET> get B<SO_REUSEADDR> such that services can be
+restarted immediately.
+All services of this library (see L<service>, L<mt_service>,
+L<preforked_service>, L<mpx_session>, and L<udp_session>) create their
+sockets by this function and provide variants which accept a profile.
+
+A null pointer for I<profile> or fields which are 0 select the
+defaults, i.e. the backlog is B<SOMAXCONN> and no further options
+are set. Otherwise, the fields of I<profile> have following meanings:
+
+=over 4
+
+=item I<backlog>
+
+Length of the queue of pending connections passed to I<listen>.
+
+=item I<rcvbuf>, I<sndbuf>
+
+Sizes of the socket buffers (B<SO_RCVBUF> and B<SO_SNDBUF>).
+Large buffers favour throughput, small buffers limit the amount
+of data which is queued in the kernel.
+
+=item I<reuseport>
+
+Sets B<SO_REUSEPORT> such that multiple sockets can be bound to the
+same address, e.g. one per thread or process, and the kernel
+distributes incoming connections among them.
+
+=item I<v6only>
+
+Restricts IPv6 sockets to IPv6 (B<IPV6_V6ONLY>) such that the IPv4
+address of the same port can be served by a separate socket.
+
+=item I<nodelay>
+
+Disables Nagle's algorithm (B<TCP_NODELAY>) for all accepted
+connections such that small responses are sent immediately.
+
+=item I<defer_accept>
+
+Connections are not reported to be ready for I<accept> before
+the first data arrived or the given number of seconds passed
+(B<TCP_DEFER_ACCEPT>, Linux only).
+
+=item I<fastopen>
+
+Enables TCP Fast Open (B<TCP_FASTOPEN>) with a queue of the given
+length for connections which have not completed the handshake yet.
+Clients which support it save a round trip for the first request.
+This option is set after I<listen> and, like all other options,
+causes I<create_listener> to fail if it is rejected.
+
+=item I<notsent_lowat>
+
+Limits the amount of data which is queued in the socket buffer
+but not sent yet (B<TCP_NOTSENT_LOWAT>) such that applications
+learn earlier that a connection is slow and fresh data does not
+wait behind stale data.
+
+=back
+
+The TCP options are applied to TCP sockets only and are inherited
+by the accepted connections. Options which are not supported by the
+platform are silently skipped with the exception of B<SO_REUSEPORT>
+which is expected by services that bind multiple sockets to
+the same address.
+
+=head1 DIAGNOSTICS
+
+I<create_listener> returns the file descriptor of the new socket
+in case of success, and -1 otherwise.
+
+=head1 AUTHOR
+
+Andreas F. Borchert
+
+=cut
+
+*/
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <afblib/listener.h>
+
+static bool set_option(int fd, int level, int option, int value) {
+   return setsockopt(fd, level, option, &value, sizeof value) == 0;
+}
+
+/* all socket types except datagram and raw sockets
+   accept connections and need listen() */
+static bool connection_oriented(int type) {
+   return type != SOCK_DGRAM && type != SOCK_RAW;
+}
+
+/* apply all options of profile that have to be set before bind() */
+static bool configure(int fd, hostport* hp, const socket_profile* profile) {
+   bool connected = connection_oriented(hp->type);
+   bool tcp = hp->type == SOCK_STREAM &&
+      (hp->domain == AF_INET || hp->domain == AF_INET6);
+   if (connected && !set_option(fd, SOL_SOCKET, SO_REUSEADDR, 1)) return false;
+   if (!profile) return true;
+   if (profile->rcvbuf > 0 &&
+	 !set_option(fd, SOL_SOCKET, SO_RCVBUF, profile->rcvbuf)) {
+      return false;
+   }
+   if (profile->sndbuf > 0 &&
+	 !set_option(fd, SOL_SOCKET, SO_SNDBUF, profile->sndbuf)) {
+      return false;
+   }
+   if (profile->reuseport) {
+#ifdef SO_REUSEPORT
+      if (!set_option(fd, SOL_SOCKET, SO_REUSEPORT, 1)) return false;
+#else
+      errno = ENOPROTOOPT; return false;
+#endif
+   }
+   if (profile->v6only && hp->domain == AF_INET6 &&
+	 !set_option(fd, IPPROTO_IPV6, IPV6_V6ONLY, 1)) {
+      return false;
+   }
+   if (!tcp) return true;
+   if (profile->nodelay &&
+	 !set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1)) {
+      return false;
+   }
+#ifdef TCP_DEFER_ACCEPT
+   if (profile->defer_accept > 0 && !set_option(fd, IPPROTO_TCP,
+	 TCP_DEFER_ACCEPT, profile->defer_accept)) {
+      return false;
+   }
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+   if (profile->notsent_lowat > 0 && !set_option(fd, IPPROTO_TCP,
+	 TCP_NOTSENT_LOWAT, profile->notsent_lowat)) {
+      return false;
+   }
+#endif
+   return true;
+}
+
+int create_listener(hostport* hp, const socket_profile* profile) {
+   if (!hp->type) {
+      hp->type = SOCK_STREAM;
+   }
+   int sfd = socket(hp->domain, hp->type, hp->protocol);
+   if (sfd < 0) return -1;
+   if (!configure(sfd, hp, profile) ||
+	 bind(sfd, (struct sockaddr *) &hp->addr, hp->namelen) < 0) {
+      close(sfd); return -1;
+   }
+   if (!connection_oriented(hp->type)) return sfd;
+   int backlog = profile && profile->backlog > 0?
+      profile->backlog: SOMAXCONN;
+   if (listen(sfd, backlog) < 0) {
+      close(sfd); return -1;
+   }
+#ifdef TCP_FASTOPEN
+   /* the queue length of TCP_FASTOPEN may be set after listen() */
+   if (profile && profile->fastopen > 0 && hp->type == SOCK_STREAM &&
+	 (hp->domain == AF_INET || hp->domain == AF_INET6) &&
+	 !set_option(sfd, IPPROTO_TCP, TCP_FASTOPEN, profile->fastopen)) {
+      close(sfd); return -1;
+   }
+#endif
+   return sfd;
+}
@@ -0,0 +1,40 @@
+/*
+   Small library of useful utilities
+   Copyright (C) 2026 Andreas Franz Borchert
+   --------------------------------------------------------------------
+   This library is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#ifndef AFBLIB_LISTENER_H
+#define AFBLIB_LISTENER_H
+
+#include <stdbool.h>
+#include <afblib/hostport.h>
+
+typedef struct socket_profile {
+   int backlog; /* for listen(), SOMAXCONN if 0 */
+   int rcvbuf, sndbuf; /* SO_RCVBUF and SO_SNDBUF, system default if 0 */
+   bool reuseport; /* SO_REUSEPORT */
+   bool v6only; /* IPV6_V6ONLY for IPv6 sockets */
+   /* TCP only; inherited by accepted connections */
+   bool nodelay; /* TCP_NODELAY */
+   int defer_accept; /* TCP_DEFER_ACCEPT in seconds, off if 0 */
+   int fastopen; /* queue length for TCP_FASTOPEN, off if 0 */
+   int notsent_lowat; /* TCP_NOTSENT_LOWAT in bytes, off if 0 */
+} socket_profile;
+
+int create_listener(hostport* hp, const socket_profile* profile);
+
+#endif
@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2003, 2008, 2013, 2014, 2021 Andreas Franz Borchert
+   Copyright (C) 2003, 2008, 2013, 2014, 2021, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -39,16 +39,28 @@ mpx_session -- run a multiplexed network service on a given port
    void run_mpx_service(hostport* hp, const char* regexp,
       mpx_handler ohandler, mpx_handler rhandler, mpx_handler hhandler,
       void* global_handle);
+   void run_mpx_service_with_profile(hostport* hp,
+      const socket_profile* profile, const char* regexp,
+      mpx_handler ohandler, mpx_handler rhandler, mpx_handler hhandler,
+      void* global_handle);
 
    int mpx_session_scan(session* s, ...);
    int mpx_session_printf(session* s, const char* restrict format, ...);
    int mpx_session_vprintf(session* s, const char* restrict format, va_list ap);
    void close_session(session* s);
 
+   size_t mpx_session_queue_size(session* s);
+   int mpx_session_listener(session* s);
+   void mpx_session_set_watermarks(session* s, size_t high, size_t low);
+   void mpx_session_set_timeouts(session* s, unsigned int idle,
+      unsigned int read, unsigned int write);
+
 =head1 DESCRIPTION
 
 I<run_mpx_service> creates a socket that listens on the given hostport,
-accepts all incoming connections, invokes I<ohandler>, if non-null,
+and on all hostports chained to it through the I<next> field as
+returned by I<get_all_hostports> (see L<hostport>), accepts all
+incoming connections on them within one event loop, invokes I<ohandler>, if non-null,
 for each incoming connection, I<rhandler> for
 every input record that matches I<regexp> (see L<pcrepattern>),
 and I<hhandler>, if non-null, whenever a network connection terminates.
@@ -94,6 +106,32 @@ I<close_session> may be called to initiate the shutdown
 of a session, i.e. no further input packets will be processed,
 just the pending response packets will be taken care of.
 
+I<mpx_session_queue_size> returns the number of bytes which have
+been generated for I<s> but not sent yet. I<mpx_session_set_watermarks>
+allows to stop the processing of further requests of I<s> as soon
+as more than I<high> bytes are waiting to be sent until the
+output queue has been drained down to I<low> bytes
+(see I<set_link_watermarks> in L<multiplexor>). Request handlers
+may use these functions to shed or delay work for slow clients.
+I<mpx_session_set_timeouts> configures the idle, read, and write
+timeouts of I<s> in milliseconds, see I<set_link_timeouts> in
+L<multiplexor>.
+
+Sessions hold an input buffer only as long as they have
+unprocessed input. Buffers are borrowed from the pool of the
+multiplexor (see I<mpx_borrow_buffer> in L<multiplexor>) and
+returned as soon as all received input has been processed such that
+idle sessions do not tie up any buffer space.
+
+I<mpx_session_listener> returns the position of the hostport which
+accepted the connection of I<s> within the list passed to
+I<run_mpx_service>, starting from 0.
+
+I<run_mpx_service_with_profile> works like I<run_mpx_service> but
+configures the listening sockets according to I<profile> (see
+L<listener>). IPv6 sockets are restricted to IPv6 in case of
+multiple hostports independently of I<profile>.
+
 I<run_mpx_service> runs normally infinitely and returns in
 error cases only.
 
@@ -178,6 +216,7 @@ Andreas F. Borchert
 */
 
 #include <assert.h>
+#include <errno.h>
 #include <pcre.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -187,6 +226,7 @@ Andreas F. Borchert
 #include <afblib/mpx_session.h>
 #include <afblib/multiplexor.h>
 #include <afblib/sliding_buffer.h>
+#include <afblib/slab.h>
 
 /* global data structure which is passed through the mpx_handle pointer */
 typedef struct mpx_service {
@@ -202,16 +242,18 @@ typedef struct mpx_service {
    int ovecsize;
 } mpx_service;
 
+static slab_cache session_cache = SLAB_CACHE_INITIALIZER("session", session);
+
 void mpx_open_handler(connection* link) {
    mpx_service* mpxs = (mpx_service*) link->mpx_handle;
    assert(mpxs);
-   session* newsession = malloc(sizeof(session));
+   session* newsession = slab_alloc(&session_cache);
    if (newsession == 0) {
       close_link(link); return;
    }
    int* ovector = calloc(mpxs->ovecsize, sizeof(int));
    if (ovector == 0) {
-      free(newsession); close_link(link); return;
+      slab_free(&session_cache, newsession); close_link(link); return;
    }
    *newsession = (session) {
       .ovector = ovector,
@@ -223,17 +265,38 @@ void mpx_open_handler(connection* link) {
    if (mpxs->ohandler) (*mpxs->ohandler)(newsession);
 }
 
+/* return the input buffer to the pool of the multiplexor */
+static void return_buffer(session* s) {
+   mpx_return_buffer(s->link->mpx, s->buffer.sa.s, s->buffer.sa.a);
+   s->buffer = (sliding_buffer) {0};
+}
+
 static void mpx_input_handler(connection* link) {
    assert(link->handle);
    session* s = (session*) link->handle;
    mpx_service* mpxs = (mpx_service*) link->mpx_handle;
 
+   /* borrow an input buffer unless we have unprocessed input */
+   if (!s->buffer.sa.s) {
+      size_t size;
+      char* buf = mpx_borrow_buffer(link->mpx, &size);
+      if (!buf) {
+	 close_link(link); return;
+      }
+      s->buffer = (sliding_buffer) {.sa = {.s = buf, .a = size}};
+   }
+
    /* read next input packet */
    if (!sliding_buffer_ready(&s->buffer, 2048)) {
       close_link(link); return;
    }
    ssize_t nbytes = read_from_link(link,
       s->buffer.sa.s + s->buffer.sa.len, s->buffer.sa.a - s->buffer.sa.len);
+   /* interrupted reads are retried at the next readiness event */
+   if (nbytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+      if (s->buffer.offset == s->buffer.sa.len) return_buffer(s);
+      return;
+   }
    if (nbytes > 0) s->buffer.sa.len += nbytes;
 
    /* process every complete request found in the current input buffer */
@@ -260,6 +323,8 @@ static void mpx_input_handler(connection* link) {
 	 like, for example, getting input that is not matched */
       close_link(link); return;
    }
+   /* idle sessions need no input buffer */
+   if (s->buffer.offset == s->buffer.sa.len) return_buffer(s);
 }
 
 static void mpx_close_handler(connection* link) {
@@ -269,9 +334,9 @@ static void mpx_close_handler(connection* link) {
       if (mpxs->hhandler) {
 	 (*mpxs->hhandler)(s);
       }
-      sliding_buffer_free(&s->buffer);
+      return_buffer(s);
       free(s->ovector);
-      free(s);
+      slab_free(&session_cache, s);
    }
 }
 
@@ -280,6 +345,19 @@ void close_session(session* s) {
    close_link(s->link);
 }
 
+size_t mpx_session_queue_size(session* s) {
+   return get_link_queue_size(s->link);
+}
+
+void mpx_session_set_watermarks(session* s, size_t high, size_t low) {
+   set_link_watermarks(s->link, high, low);
+}
+
+void mpx_session_set_timeouts(session* s, unsigned int idle,
+      unsigned int read, unsigned int write) {
+   set_link_timeouts(s->link, idle, read, write);
+}
+
 static bool have_jit_support() {
    static bool initialized = false;
    static bool have_support = false;
@@ -321,13 +399,19 @@ int mpx_session_vprintf(session* s, const char* restrict format, va_list ap) {
    /* for each call of vsnprintf we need a separate copy of ap;
       see http://www.bailopan.net/blog/?p=30 */
    va_list ap2; va_copy(ap2, ap);
-   /* let vsnprintf compute how many bytes are generated */
-   int nbytes = vsnprintf(0, 0, format, ap);
-
-   if (nbytes > 0) {
+   /* short lines are formatted on the stack and copied into the
+      output arena of the connection; otherwise vsnprintf tells us
+      how many bytes are generated */
+   char line[256];
+   int nbytes = vsnprintf(line, sizeof line, format, ap);
+   if (nbytes >= 0 && nbytes < sizeof line) {
+      if (nbytes > 0 && !copy_to_link(s->link, line, nbytes)) {
+	 nbytes = -1;
+      }
+   } else if (nbytes > 0) {
       char* buf = malloc(nbytes + 1);
       if (!buf) {
-	 va_end(ap); return -1;
+	 va_end(ap2); return -1;
       }
       nbytes = vsnprintf(buf, nbytes + 1, format, ap2);
       if (nbytes > 0) {
@@ -348,21 +432,42 @@ int mpx_session_printf(session* s, const char* restrict format, ...) {
    return nbytes;
 }
 
+int mpx_session_listener(session* s) {
+   return get_link_listener(s->link);
+}
+
+static void close_sockets(int* sockets, size_t nsockets) {
+   for (size_t i = 0; i < nsockets; ++i) {
+      close(sockets[i]);
+   }
+}
+
 void run_mpx_service(hostport* hp, const char* regexp,
       mpx_handler ohandler, mpx_handler rhandler, mpx_handler hhandler,
       void* global_handle) {
-   if (!hp->type) {
-      hp->type = SOCK_STREAM;
-   }
-   int sfd = socket(hp->domain, hp->type, hp->protocol);
-   int optval = 1;
-   if (sfd < 0 ||
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR,
-                   &optval, sizeof optval) < 0 ||
-        bind(sfd, (struct sockaddr *) &hp->addr, hp->namelen) < 0 ||
-        listen(sfd, SOMAXCONN) < 0) {
-      close(sfd);
-      return;
+   run_mpx_service_with_profile(hp, 0, regexp,
+      ohandler, rhandler, hhandler, global_handle);
+}
+
+void run_mpx_service_with_profile(hostport* hp,
+      const socket_profile* profile, const char* regexp,
+      mpx_handler ohandler, mpx_handler rhandler, mpx_handler hhandler,
+      void* global_handle) {
+   size_t nsockets = 0;
+   for (hostport* p = hp; p; p = p->next) ++nsockets;
+   if (nsockets == 0) return;
+   /* IPv6 sockets are restricted to IPv6 if IPv4 addresses
+      are to be served by separate sockets */
+   socket_profile sp = {0};
+   if (profile) sp = *profile;
+   if (nsockets > 1) sp.v6only = true;
+   int sockets[nsockets];
+   for (size_t i = 0; i < nsockets; ++i, hp = hp->next) {
+      sockets[i] = create_listener(hp, &sp);
+      if (sockets[i] < 0) {
+         close_sockets(sockets, i);
+         return;
+      }
    }
 
    /* prepare regular expression directed input parsing */
@@ -371,13 +476,13 @@ void run_mpx_service(hostport* hp, const char* regexp,
    pcre* compiled = pcre_compile(regexp, options, &errormsg, &errpos, 0);
    if (!compiled) {
       /* parsing of regular expression failed */
-      close(sfd);
+      close_sockets(sockets, nsockets);
       return;
    }
    int capture_count = 0;
    if (pcre_fullinfo(compiled, 0, PCRE_INFO_CAPTURECOUNT, &capture_count)) {
       pcre_free(compiled);
-      close(sfd);
+      close_sockets(sockets, nsockets);
       return;
    }
    int ovecsize = (capture_count + 1) << 2;
@@ -393,7 +498,9 @@ void run_mpx_service(hostport* hp, const char* regexp,
    /* set up our handle */
    mpx_service* mpxs = malloc(sizeof(mpx_service));
    if (mpxs == 0) {
-      pcre_free(compiled); close(sfd); free(mpxs);
+      pcre_free_study(extra); pcre_free(compiled);
+      close_sockets(sockets, nsockets);
+      return;
    }
    *mpxs = (mpx_service) {
       .global_handle = global_handle,
@@ -406,6 +513,13 @@ void run_mpx_service(hostport* hp, const char* regexp,
       .ovecsize = ovecsize,
    };
 
-   run_multiplexor(sfd, mpx_open_handler, mpx_input_handler,
-      mpx_close_handler, (void*) mpxs);
+   struct multiplexor* mpx = mpx_setup_sockets(sockets, nsockets,
+      mpx_open_handler, mpx_input_handler, mpx_close_handler,
+      (void*) mpxs);
+   if (mpx) {
+      mpx_run(mpx);
+      mpx_free(mpx);
+   }
+   pcre_free_study(extra); pcre_free(compiled); free(mpxs);
+   close_sockets(sockets, nsockets);
 }
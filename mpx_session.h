@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2003, 2008, 2013, 2014 Andreas Franz Borchert
+   Copyright (C) 2003, 2008, 2013, 2014, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -23,6 +23,7 @@
 #include <stralloc.h>
 #include <sys/types.h>
 #include <afblib/hostport.h>
+#include <afblib/listener.h>
 #include <afblib/multiplexor.h>
 #include <afblib/sliding_buffer.h>
 
@@ -52,8 +53,18 @@ int mpx_session_printf(session* s, const char* restrict format, ...);
 int mpx_session_vprintf(session* s, const char* restrict format, va_list ap);
 void close_session(session* s);
 
+size_t mpx_session_queue_size(session* s);
+int mpx_session_listener(session* s);
+void mpx_session_set_watermarks(session* s, size_t high, size_t low);
+void mpx_session_set_timeouts(session* s, unsigned int idle,
+   unsigned int read, unsigned int write);
+
 void run_mpx_service(hostport* hp, const char* regexp,
    mpx_handler ohandler, mpx_handler rhandler, mpx_handler hhandler,
    void* global_handle);
+void run_mpx_service_with_profile(hostport* hp,
+   const socket_profile* profile, const char* regexp,
+   mpx_handler ohandler, mpx_handler rhandler, mpx_handler hhandler,
+   void* global_handle);
 
 #endif
@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2021 Andreas Franz Borchert
+   Copyright (C) 2021, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -30,6 +30,23 @@ run_mt_service -- run a TCP-based service on a given hostport using a thread per
 
    void run_mt_service(hostport* hp, session_handler handler,
       void* service_handle);
+   void run_mt_service_with_profile(hostport* hp,
+      const socket_profile* profile,
+      session_handler handler, void* service_handle);
+
+   typedef struct mt_service_config {
+      unsigned int min_threads;
+      unsigned int max_threads;
+      unsigned int queue_size;
+      size_t stack_size;
+      unsigned int idle_timeout;
+      unsigned int acceptors;
+      const int* cpus;
+   } mt_service_config;
+
+   void run_mt_service_with_config(hostport* hp,
+      const socket_profile* profile, const mt_service_config* config,
+      session_handler handler, void* service_handle);
 
 =head1 DESCRIPTION
 
@@ -40,7 +57,72 @@ with the provided handle I<service_handle>.  As soon the session
 handler returns, the spawned off process terminates with an exit code
 of 0.
 
-I<run_mt_service> terminates only in case of errors.
+I<run_mt_service_with_profile> works like I<run_mt_service> but
+configures the listening socket according to I<profile> (see L<listener>).
+
+I<run_mt_service_with_config> runs the sessions within a pool of
+threads instead if I<config> is non-null. The accepting thread puts new
+connections into a queue from which they are taken by idle worker
+threads of the pool. This saves the creation of a thread for each
+connection and bounds the number of threads in case of bursts.
+The fields of I<config> are interpreted as follows, where 0 selects
+the default:
+
+=over 4
+
+=item I<min_threads>
+
+Number of worker threads which are started in advance and which are
+kept even if they are idle. By default, the number returned by
+I<get_hardware_concurrency> (see L<concurrency>) is taken.
+
+=item I<max_threads>
+
+Maximal number of worker threads. Further threads are started on demand
+when connections are waiting in the queue and no worker is idle.
+By default, the pool does not grow beyond I<min_threads>.
+
+=item I<queue_size>
+
+Maximal number of accepted connections waiting for a worker.
+If the queue is full, no further connections are accepted until
+a worker becomes available, i.e. pending connections remain in the
+backlog of the listening socket. By default, this is I<max_threads>.
+
+=item I<stack_size>
+
+Stack size of the worker threads in bytes. The system default is
+taken by default.
+
+=item I<idle_timeout>
+
+Number of seconds after which idle worker threads beyond I<min_threads>
+terminate. Defaults to 60 seconds.
+
+=item I<acceptors>
+
+Number of listening sockets, each with its own accepting thread and its
+own pool of worker threads to which the other fields apply. If more
+than one acceptor is requested, the sockets are bound to the same
+address with B<SO_REUSEPORT> and the kernel distributes incoming
+connections among them. This requires I<hp> to specify a port.
+By default, there is just one acceptor.
+
+=item I<cpus>
+
+If non-null, I<cpus[i]> specifies the CPU to which the I<i>-th acceptor
+and its workers are bound, such that sessions are run on the CPU which
+accepted their connections. Negative values leave the corresponding
+acceptor unbound, and so do CPUs which are not available to the
+process. This is supported under Linux only and ignored elsewhere.
+
+=back
+
+A null pointer for I<config> selects one thread per connection.
+
+I<run_mt_service> terminates only in case of errors. If a pool is
+used, I<run_mt_service_with_config> waits until all connections
+that have been accepted so far are processed.
 
 =head1 AUTHOR
 
@@ -50,12 +132,28 @@ Andreas F. Borchert
 
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* needed for pthread_attr_setaffinity_np */
+#endif
+
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
+#include <afblib/concurrency.h>
 #include <afblib/mt_service.h>
 
+#ifdef __linux__
+#include <sched.h>
+#define HAVE_AFFINITY
+#endif
+
+#define DEFAULT_IDLE_TIMEOUT 60 /* seconds */
+
 struct session_parameters {
    session_handler handler;
    int fd;
@@ -73,20 +171,240 @@ void* spawn_session(void* arg) {
    incoming connection in a new thread */
 void run_mt_service(hostport* hp, session_handler handler,
       void* service_handle) {
-   if (!hp->type) {
-      hp->type = SOCK_STREAM;
-   }
-   int sfd = socket(hp->domain, hp->type, hp->protocol);
-   int optval = 1;
-   if (sfd < 0 ||
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR,
-                   &optval, sizeof optval) < 0 ||
-        bind(sfd, (struct sockaddr *) &hp->addr, hp->namelen) < 0 ||
-        listen(sfd, SOMAXCONN) < 0) {
-      close(sfd);
+   run_mt_service_with_profile(hp, 0, handler, service_handle);
+}
+
+/* pool of worker threads which take accepted connections from a queue */
+typedef struct worker_pool {
+   pthread_mutex_t mutex; /* protects all following fields */
+   pthread_cond_t ready; /* queue is non-empty or pool terminates */
+   pthread_cond_t space; /* queue is not full */
+   pthread_cond_t done; /* a worker terminated */
+   int* queue; /* ring buffer of accepted connections */
+   unsigned int queue_size, head, count;
+   unsigned int threads; /* number of running workers */
+   unsigned int idle; /* number of workers waiting for connections */
+   unsigned int min_threads, max_threads;
+   unsigned int idle_timeout;
+   bool terminating;
+   pthread_attr_t attr; /* of the worker threads */
+   session_handler handler;
+   void* service_handle;
+} worker_pool;
+
+static void* run_worker(void* arg) {
+   worker_pool* pool = arg;
+   pthread_mutex_lock(&pool->mutex);
+   for(;;) {
+      bool timedout = false;
+      while (pool->count == 0 && !pool->terminating && !timedout) {
+	 ++pool->idle;
+	 if (pool->threads > pool->min_threads) {
+	    struct timespec deadline;
+	    clock_gettime(CLOCK_REALTIME, &deadline);
+	    deadline.tv_sec += pool->idle_timeout;
+	    timedout = pthread_cond_timedwait(&pool->ready, &pool->mutex,
+	       &deadline) == ETIMEDOUT;
+	 } else {
+	    pthread_cond_wait(&pool->ready, &pool->mutex);
+	 }
+	 --pool->idle;
+	 /* another worker may have terminated in the meantime */
+	 if (timedout && pool->threads <= pool->min_threads) timedout = false;
+      }
+      if (pool->count == 0) break;
+      int fd = pool->queue[pool->head];
+      pool->head = (pool->head + 1) % pool->queue_size;
+      --pool->count;
+      pthread_cond_signal(&pool->space);
+      pthread_mutex_unlock(&pool->mutex);
+      pool->handler(fd, pool->service_handle);
+      pthread_mutex_lock(&pool->mutex);
+   }
+   --pool->threads;
+   pthread_cond_signal(&pool->done);
+   pthread_mutex_unlock(&pool->mutex);
+   return 0;
+}
+
+/* start another worker; pool must be locked */
+static bool start_worker(worker_pool* pool) {
+   pthread_t thread;
+   if (pthread_create(&thread, &pool->attr, run_worker, pool)) return false;
+   ++pool->threads;
+   return true;
+}
+
+/* bind the threads created with attr to the given cpu, if it is
+   available to our process */
+static void set_affinity(pthread_attr_t* attr, int cpu) {
+#ifdef HAVE_AFFINITY
+   cpu_set_t cpus;
+   if (cpu >= 0 && cpu < CPU_SETSIZE &&
+	 sched_getaffinity(0, sizeof cpus, &cpus) == 0 &&
+	 CPU_ISSET(cpu, &cpus)) {
+      CPU_ZERO(&cpus); CPU_SET(cpu, &cpus);
+      pthread_attr_setaffinity_np(attr, sizeof cpus, &cpus);
+   }
+#endif
+}
+
+static bool init_pool(worker_pool* pool, const mt_service_config* config,
+      int cpu, session_handler handler, void* service_handle) {
+   unsigned int min_threads = config->min_threads;
+   if (min_threads == 0) min_threads = get_hardware_concurrency();
+   if (min_threads == 0) min_threads = 1;
+   unsigned int max_threads = config->max_threads;
+   if (max_threads < min_threads) max_threads = min_threads;
+   unsigned int queue_size = config->queue_size;
+   if (queue_size == 0) queue_size = max_threads;
+   *pool = (worker_pool) {
+      .mutex = PTHREAD_MUTEX_INITIALIZER,
+      .ready = PTHREAD_COND_INITIALIZER,
+      .space = PTHREAD_COND_INITIALIZER,
+      .done = PTHREAD_COND_INITIALIZER,
+      .queue_size = queue_size,
+      .min_threads = min_threads,
+      .max_threads = max_threads,
+      .idle_timeout = config->idle_timeout?
+	 config->idle_timeout: DEFAULT_IDLE_TIMEOUT,
+      .handler = handler,
+      .service_handle = service_handle,
+   };
+   pool->queue = malloc(queue_size * sizeof(int));
+   if (!pool->queue) return false;
+   if (pthread_attr_init(&pool->attr)) {
+      free(pool->queue); return false;
+   }
+   pthread_attr_setdetachstate(&pool->attr, PTHREAD_CREATE_DETACHED);
+   if (config->stack_size) {
+      size_t stack_size = config->stack_size;
+      if (stack_size < PTHREAD_STACK_MIN) stack_size = PTHREAD_STACK_MIN;
+      pthread_attr_setstacksize(&pool->attr, stack_size);
+   }
+   set_affinity(&pool->attr, cpu);
+   pthread_mutex_lock(&pool->mutex);
+   while (pool->threads < min_threads && start_worker(pool));
+   bool ok = pool->threads > 0;
+   pthread_mutex_unlock(&pool->mutex);
+   if (!ok) {
+      pthread_attr_destroy(&pool->attr); free(pool->queue);
+   }
+   return ok;
+}
+
+/* hand fd over to the pool; blocks while the queue is full */
+static void submit_connection(worker_pool* pool, int fd) {
+   pthread_mutex_lock(&pool->mutex);
+   while (pool->count == pool->queue_size) {
+      pthread_cond_wait(&pool->space, &pool->mutex);
+   }
+   pool->queue[(pool->head + pool->count) % pool->queue_size] = fd;
+   ++pool->count;
+   if (pool->idle < pool->count && pool->threads < pool->max_threads) {
+      start_worker(pool);
+   }
+   pthread_cond_signal(&pool->ready);
+   pthread_mutex_unlock(&pool->mutex);
+}
+
+/* let all workers terminate after the queue has been processed */
+static void shutdown_pool(worker_pool* pool) {
+   pthread_mutex_lock(&pool->mutex);
+   pool->terminating = true;
+   pthread_cond_broadcast(&pool->ready);
+   while (pool->threads > 0) {
+      pthread_cond_wait(&pool->done, &pool->mutex);
+   }
+   pthread_mutex_unlock(&pool->mutex);
+   pthread_attr_destroy(&pool->attr);
+   free(pool->queue);
+}
+
+/* listening socket with its own thread and pool of workers */
+typedef struct acceptor {
+   int socket;
+   int cpu; /* -1 if not bound to a cpu */
+   pthread_t thread;
+   worker_pool pool;
+} acceptor;
+
+static void* run_acceptor(void* arg) {
+   acceptor* acceptor = arg;
+   int fd;
+   while ((fd = accept(acceptor->socket, 0, 0)) >= 0) {
+      submit_connection(&acceptor->pool, fd);
+   }
+   close(acceptor->socket);
+   shutdown_pool(&acceptor->pool);
+   return 0;
+}
+
+/* run the given number of acceptors which share the address of hp */
+static void run_acceptors(hostport* hp, const socket_profile* profile,
+      const mt_service_config* config, unsigned int nacceptors,
+      session_handler handler, void* service_handle) {
+   socket_profile sp = {0};
+   if (profile) sp = *profile;
+   if (nacceptors > 1) sp.reuseport = true;
+   acceptor acceptors[nacceptors];
+   unsigned int count = 0;
+   while (count < nacceptors) {
+      acceptor* acceptor = &acceptors[count];
+      acceptor->cpu = config->cpus? config->cpus[count]: -1;
+      acceptor->socket = create_listener(hp, &sp);
+      if (acceptor->socket < 0) break;
+      if (!init_pool(&acceptor->pool, config, acceptor->cpu,
+	    handler, service_handle)) {
+	 close(acceptor->socket); break;
+      }
+      ++count;
+   }
+   if (count < nacceptors) {
+      /* run either all acceptors or none of them */
+      for (unsigned int i = 0; i < count; ++i) {
+	 close(acceptors[i].socket); shutdown_pool(&acceptors[i].pool);
+      }
       return;
    }
 
+   unsigned int started = 0;
+   for (; started < nacceptors; ++started) {
+      acceptor* acceptor = &acceptors[started];
+      pthread_attr_t attr;
+      if (pthread_attr_init(&attr)) break;
+      set_affinity(&attr, acceptor->cpu);
+      bool ok = pthread_create(&acceptor->thread, &attr,
+	 run_acceptor, acceptor) == 0;
+      pthread_attr_destroy(&attr);
+      if (!ok) break;
+   }
+   for (unsigned int i = started; i < nacceptors; ++i) {
+      close(acceptors[i].socket); shutdown_pool(&acceptors[i].pool);
+   }
+   for (unsigned int i = 0; i < started; ++i) {
+      pthread_join(acceptors[i].thread, 0);
+   }
+}
+
+void run_mt_service_with_profile(hostport* hp,
+      const socket_profile* profile,
+      session_handler handler, void* service_handle) {
+   run_mt_service_with_config(hp, profile, 0, handler, service_handle);
+}
+
+void run_mt_service_with_config(hostport* hp,
+      const socket_profile* profile, const mt_service_config* config,
+      session_handler handler, void* service_handle) {
+   if (config) {
+      unsigned int nacceptors = config->acceptors? config->acceptors: 1;
+      run_acceptors(hp, profile, config, nacceptors, handler, service_handle);
+      return;
+   }
+
+   int sfd = create_listener(hp, profile);
+   if (sfd < 0) return;
+
    int fd;
    while ((fd = accept(sfd, 0, 0)) >= 0) {
       struct session_parameters* pp = malloc(sizeof(struct session_parameters));
@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2021 Andreas Franz Borchert
+   Copyright (C) 2021, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -20,6 +20,7 @@
 #define AFBLIB_SERVICE_H
 
 #include <afblib/hostport.h>
+#include <afblib/listener.h>
 
 typedef void (*session_handler)(int fd, void* service_handle);
 
@@ -27,5 +28,24 @@ typedef void (*session_handler)(int fd, void* service_handle);
    incoming connection */
 void run_mt_service(hostport* hp, session_handler handler,
    void* service_handle);
+void run_mt_service_with_profile(hostport* hp,
+   const socket_profile* profile,
+   session_handler handler, void* service_handle);
+
+typedef struct mt_service_config {
+   unsigned int min_threads; /* started in advance */
+   unsigned int max_threads; /* started on demand up to this limit */
+   unsigned int queue_size; /* of connections waiting for a thread */
+   size_t stack_size; /* of the worker threads */
+   unsigned int idle_timeout; /* in seconds for threads beyond min_threads */
+   unsigned int acceptors; /* number of listening sockets with SO_REUSEPORT */
+   const int* cpus; /* cpu of each acceptor and its workers, if non-null */
+} mt_service_config;
+
+/* like run_mt_service_with_profile but with a pool of threads
+   if config is non-null */
+void run_mt_service_with_config(hostport* hp,
+   const socket_profile* profile, const mt_service_config* config,
+   session_handler handler, void* service_handle);
 
 #endif
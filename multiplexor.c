@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2003, 2008, 2013, 2017, 2019 Andreas Franz Borchert
+   Copyright (C) 2003, 2008, 2013, 2017, 2019, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -31,20 +31,105 @@ multiplexor -- handle concurrent network sessions
       int fd;
       void* handle;
       void* mpx_handle;
+      struct multiplexor* mpx;
       // additional private fields
    } connection;
 
    typedef void (*multiplexor_handler)(connection* link);
+   typedef void (*mpx_timer_handler)(struct multiplexor* mpx, void* arg);
+   typedef void (*mpx_post_handler)(struct multiplexor* mpx, void* arg);
+   typedef void (*mpx_watch_handler)(struct multiplexor* mpx,
+      int fd, short revents, void* arg);
+
+   typedef enum {
+      MPX_ENGINE_DEFAULT, MPX_ENGINE_POLL, MPX_ENGINE_EPOLL,
+      MPX_ENGINE_IO_URING,
+   } mpx_engine;
 
    void run_multiplexor(int socket,
       multiplexor_handler open_handler,
       multiplexor_handler input_handler,
       multiplexor_handler close_handler,
       void* mpx_handle);
+   void run_multiplexor_mt(int socket, unsigned int nthreads,
+      multiplexor_handler open_handler,
+      multiplexor_handler input_handler,
+      multiplexor_handler close_handler,
+      void* mpx_handle);
+
+   struct multiplexor* mpx_setup(int socket,
+      multiplexor_handler open_handler,
+      multiplexor_handler input_handler,
+      multiplexor_handler close_handler,
+      void* mpx_handle);
+   struct multiplexor* mpx_setup_sockets(const int* sockets, size_t nsockets,
+      multiplexor_handler open_handler,
+      multiplexor_handler input_handler,
+      multiplexor_handler close_handler,
+      void* mpx_handle);
+   bool mpx_set_engine(struct multiplexor* mpx, mpx_engine engine);
+   void mpx_set_watermarks(struct multiplexor* mpx, size_t high, size_t low);
+   bool mpx_set_zerocopy(struct multiplexor* mpx, size_t threshold);
+   void mpx_set_shedding(struct multiplexor* mpx, unsigned int max_lag,
+      mpx_shedding policy);
+   void mpx_get_load(struct multiplexor* mpx, mpx_load* load);
+   void mpx_enable_stats(struct multiplexor* mpx, bool enable);
+   void mpx_get_stats(struct multiplexor* mpx, mpx_stats* stats);
+   uint64_t mpx_histogram_percentile(const mpx_histogram* histogram,
+      double percentile);
+   void mpx_set_read_budget(struct multiplexor* mpx,
+      size_t bytes, unsigned int calls);
+   void mpx_set_timeouts(struct multiplexor* mpx, unsigned int idle,
+      unsigned int read, unsigned int write);
+   mpx_engine mpx_get_engine(struct multiplexor* mpx);
+   void mpx_run(struct multiplexor* mpx);
+   void mpx_free(struct multiplexor* mpx);
+
    bool write_to_link(connection* link, char* buf, size_t len);
+   bool copy_to_link(connection* link, const char* buf, size_t len);
+   bool write_file_to_link(connection* link, int fd, off_t offset, size_t len);
    ssize_t read_from_link(connection* link, char* buf, size_t len);
+   connection* mpx_connect(struct multiplexor* mpx, const hostport* hp,
+      multiplexor_handler open_handler,
+      multiplexor_handler input_handler,
+      multiplexor_handler close_handler,
+      void* handle);
+   bool splice_links(connection* link1, connection* link2);
+   connection* proxy_link(connection* link, const hostport* hp);
    void close_link(connection* link);
 
+   typedef uint64_t mpx_link_id;
+   mpx_link_id get_link_id(connection* link);
+   int get_link_listener(connection* link);
+   connection* mpx_get_link(struct multiplexor* mpx, mpx_link_id id);
+
+   void set_link_watermarks(connection* link, size_t high, size_t low);
+   void set_link_read_budget(connection* link, size_t bytes,
+      unsigned int calls);
+   size_t get_link_queue_size(connection* link);
+   void set_link_timeouts(connection* link, unsigned int idle,
+      unsigned int read, unsigned int write);
+
+   mpx_timer* mpx_add_timer(struct multiplexor* mpx, unsigned int ms,
+      mpx_timer_handler handler, void* arg);
+   void mpx_cancel_timer(struct multiplexor* mpx, mpx_timer* timer);
+
+   bool mpx_post(struct multiplexor* mpx, mpx_post_handler handler, void* arg);
+
+   typedef struct mpx_watch mpx_watch;
+   mpx_watch* mpx_watch_fd(struct multiplexor* mpx, int fd, short events,
+      mpx_watch_handler handler, void* arg);
+   void mpx_unwatch_fd(struct multiplexor* mpx, mpx_watch* watch);
+
+   char* mpx_borrow_buffer(struct multiplexor* mpx, size_t* size);
+   void mpx_return_buffer(struct multiplexor* mpx, char* buf, size_t size);
+   void mpx_set_buffer_pool(struct multiplexor* mpx, size_t size, size_t max);
+
+   typedef struct output_buffer output_buffer;
+   output_buffer* create_output_buffer(char* buf, size_t len);
+   bool write_shared_to_link(connection* link, output_buffer* buffer);
+   void release_output_buffer(output_buffer* buffer);
+
 =head1 DESCRIPTION
 
 These functions allow to handle multiple network connections within
@@ -86,6 +171,11 @@ This handle points to an optional handle representing the network
 service that has been passed to I<run_multiplexor>. It can be set to
 null if it is not needed.
 
+=item I<mpx>
+
+This is a reference to the multiplexor which manages this connection.
+It can be passed to all functions with an I<mpx> parameter.
+
 =back
 
 Input handlers that want to generate a response packet must use the
@@ -100,17 +190,351 @@ read the next input packet. Multiple calls are not permitted,
 i.e. each input handler, if invoked, must call I<read_from_link>
 exactly once. If I<read_from_link> gets no more input as the
 connection has been closed, the close handler will be invoked,
-if defined.
+if defined. In rare cases of spurious wakeups, I<read_from_link>
+returns -1 with I<errno> set to B<EAGAIN> without closing the
+connection.
+
+By default, the input handler is invoked once whenever input is
+available. Clients which send large amounts of data need then one
+iteration of the event loop per input packet. I<set_link_read_budget>
+switches I<link> into a mode where the input handler is invoked
+repeatedly until I<read_from_link> returns -1 with I<errno> set to
+B<EAGAIN> or a budget of I<bytes> bytes or I<calls> invocations of
+I<read_from_link> is exhausted, where 0 stands for no limit.
+In this mode, input handlers may also call I<read_from_link>
+multiple times as long as it does not return -1 with B<EAGAIN>.
+Once the budget is exhausted, I<read_from_link> fails with
+B<EAGAIN> and the connection is put into a queue of links which
+are served again in the next iteration of the event loop without
+waiting for another notification. This keeps the remaining
+connections responsive while a busy connection is drained.
+Setting both parameters to 0 returns to the default mode.
+I<mpx_set_read_budget> sets the read budget which is taken for
+new connections of I<mpx>.
+
+The listening socket is switched into non-blocking mode and, whenever
+it becomes ready, up to 64 pending connections are accepted at once.
+Accepted connections are in non-blocking and close-on-exec mode.
+Errors of I<accept> which concern individual connections only are
+ignored. If the process runs out of file descriptors, pending
+connections are accepted and closed immediately with the help of a
+spare file descriptor such that the event loop does not spin. If the
+spare file descriptor is not available or if we run out of memory,
+the listening sockets are not monitored for 50 ms. Other
+errors of I<accept> cause the listening socket to be given up.
+
+Whenever a connection becomes writable, as many pending
+output packets as possible (up to I<IOV_MAX>) are written
+by one I<writev> system call.
 
 The output buffer that is passed to I<write_to_link> is, if
 I<write_to_link> returns B<true>, subsequently owned by this module and
 freed when it is no longer needed. It must not be reused or freed by
 the caller.
 
+Each connection has an append-only output arena, i.e. a chain of
+chunks of 4 KiB which are allocated together with their entry of the
+output queue. Packets of up to 512 bytes which are passed to
+I<write_to_link> are copied into the arena and freed right away
+such that many small responses are coalesced into few queue entries
+and I<iovec> elements. Larger packets are queued by reference
+as before. Queue entries and arena chunks are taken from slab
+caches (see L<slab>). I<copy_to_link> copies I<len> bytes from I<buf> into the
+arena of I<link> regardless of their size and leaves I<buf> to the
+caller which may pass, for example, a buffer on the stack.
+It returns B<false> if it runs out of memory.
+
+I<write_file_to_link> queues I<len> bytes of the file opened
+as I<fd>, starting at I<offset>, as next output packet of I<link>.
+File ranges and packets queued by I<write_to_link> are sent in the
+order they have been queued. The file descriptor is subsequently owned
+by this module and closed as soon as the range has been sent or the
+connection terminates. If I<fd> refers to a pipe, I<offset> is
+ignored and I<len> bytes are taken from the pipe. Under Linux, the
+data is passed to the connection without copying it through user
+space by I<sendfile> in case of regular files and by I<splice> in case
+of pipes; on other platforms it is copied in chunks of 64 KiB. If a
+pipe runs empty, it is tried again after a delay which doubles
+with every further attempt up to 32 ms as long as the pipe
+remains empty. The connection is closed if less than I<len> bytes
+are available. I<write_file_to_link> returns B<false> if I<fd>
+is invalid or if it runs out of memory; I<fd> is not closed in
+this case.
+
+I<get_link_queue_size> returns the number of bytes which have been
+queued for I<link> but not sent yet. Handlers may use this to shed or
+delay work for slow clients. To prevent output queues from growing
+without bounds, I<set_link_watermarks> allows to configure a high and
+a low watermark for I<link>: as soon as more than I<high> bytes are
+queued, the input handler is no longer invoked for I<link> until its
+output queue has been drained down to I<low> bytes. A I<high> value of
+0 (the default) disables this mechanism. I<mpx_set_watermarks>
+sets the watermarks which are taken for new connections of I<mpx>.
+
+I<mpx_set_zerocopy> allows under Linux to send output packets
+of at least I<threshold> bytes with B<MSG_ZEROCOPY>, i.e. without
+copying them into the socket buffers. Such packets are sent by
+individual I<sendmsg> calls and are kept after they have been sent
+until the kernel notifies through the error queue of the socket that
+it no longer needs them. Connections are not closed before all these
+notifications have been received, unless the peer hung up or they
+are still missing two seconds after everything else has been done.
+Nothing changes for the handlers as
+packets are still owned by this module once they have been passed
+to I<write_to_link> or I<write_shared_to_link>. A I<threshold> of 0
+(the default) disables this mechanism. As pinning the pages of a
+packet is more expensive than copying small packets, the threshold
+should not be below 10 KiB. I<mpx_set_zerocopy> returns B<false> if
+B<MSG_ZEROCOPY> is not supported on this platform.
+
+I<mpx_get_load> fills I<*load> with the load statistics of I<mpx>.
+Each iteration of the event loop is split into the time spent
+waiting for events and the time which is spent in the handlers
+and the bookkeeping of the multiplexor. The latter is the time an
+event which becomes ready during an iteration has to wait until it
+is seen. Its exponentially smoothed average (with a weight of 1/8
+for the most recent iteration) is provided as I<lag> in
+microseconds. I<mpx_set_shedding> configures what happens when
+I<lag> exceeds I<max_lag> microseconds: B<MPX_SHED_PAUSE> stops
+accepting new connections such that they remain in the backlog of
+the listening socket (or are taken by other multiplexors sharing it)
+and B<MPX_SHED_REJECT> accepts and closes them immediately.
+B<MPX_SHED_NONE> (the default) or a I<max_lag> of 0 disables load
+shedding. Shedding ends as soon as I<lag> drops to I<max_lag>/2.
+While shedding, the event loop wakes up at least every 10 ms to
+update I<lag> even if no events arrive.
+
+I<mpx_get_stats> fills I<*stats> with counters of I<mpx>: the
+number of connections which were accepted and added, of connections
+which were closed right after I<accept> (by B<MPX_SHED_REJECT> or
+for lack of file descriptors), of failed I<accept> calls and of
+connections which could not be added, of successful I<read> and I<write>
+operations (including I<splice> and I<sendfile>) together with the
+number of bytes transferred, the number of bytes which are currently
+queued for output on all connections, and the number of wakeups of
+the event engine. These counters are always maintained. In addition,
+I<mpx_enable_stats> allows to record the latencies of all
+invocations of the open, input, and close handlers in histograms.
+These measurements are disabled by default as they cost two
+I<clock_gettime> calls per handler invocation. Each histogram has
+four buckets per power of two of nanoseconds, i.e. latencies are
+recorded with a relative error of at most 25%, and remembers the
+number, the sum, and the maximum of all latencies.
+I<mpx_histogram_percentile> returns the upper bound in nanoseconds
+of the bucket in which the given I<percentile> (between 0 and 100)
+of the recorded latencies falls, or 0 if the histogram is empty.
+
+Output packets which are to be sent to many connections can be
+shared instead of copied. I<create_output_buffer> takes ownership of
+I<buf> with I<len> bytes and returns a reference-counted output
+buffer, or null if it runs out of memory. I<write_shared_to_link>
+works like I<write_to_link> but queues a reference to I<buffer>. The
+caller holds the initial reference which is to be given up by
+I<release_output_buffer>, typically as soon as the buffer has been
+queued on all links. The buffer and I<buf> are freed when the last
+connection has sent it and its creator has released it. The contents
+of I<buf> must not be modified as long as a reference is held.
+Reference counts are maintained atomically, i.e. a buffer may
+be shared among the multiplexors of I<run_multiplexor_mt>.
+
+Connections which make no progress can be given up automatically
+by timeouts which are specified in milliseconds where 0 (the default)
+disables the respective timeout. I<set_link_timeouts> configures the
+timeouts of I<link>: the connection is closed if there has been no
+input and no output at all for I<idle> ms, if no input arrived for
+I<read> ms while the input handler is ready to process input, or if
+no pending output could be written for I<write> ms. Pending output is
+discarded in these cases and the close handler is invoked as usual.
+I<mpx_set_timeouts> sets the timeouts for new connections of I<mpx>.
+
+I<mpx_add_timer> arranges I<handler> to be invoked with I<mpx> and
+I<arg> once I<ms> milliseconds have passed since the start of the
+current iteration of the event loop (or since I<mpx_setup> if
+I<mpx_run> is not running yet). It returns a timer which can be
+cancelled by I<mpx_cancel_timer> as long as its handler has not
+been invoked yet, or null if it runs out of memory. Timers are
+one-shot but a handler may add new timers to implement periodic
+activities. Timers are kept in a hierarchical timer wheel with a
+resolution of 1 ms such that adding, cancelling, and expiring timers
+costs constant time. Progress on a connection does not touch the
+timer wheel at all as the timer of a connection is just rescheduled
+when it expires too early. The wait for events is limited by the
+nearest deadline. I<mpx_run> does not return as long as
+timers are pending.
+
+All functions of this module must be called from within the
+thread which runs I<mpx_run> (typically from within the handlers),
+with the exception of I<mpx_post> and the functions which operate on
+output buffers. I<mpx_post> may be called by any thread to get
+I<handler> invoked with I<mpx> and I<arg> by the thread of the
+event loop of I<mpx>. This allows to process requests by other
+threads and to hand their results back to the multiplexor, e.g. by
+invoking I<write_to_link> or I<close_link> from within I<handler>.
+Posted handlers are invoked in the order of their submission. The
+event loop is woken up through an I<eventfd> under Linux, or through a
+pipe otherwise, which is written to only if the queue of posted
+handlers was empty. I<mpx_post> returns B<false> if it runs out of
+memory. As connections may terminate in the meantime, the application
+must make sure that a connection is still alive before it is
+referenced by a posted handler, preferably by passing its id (see
+below) instead of a pointer. Handlers which are still pending when
+I<mpx_run> returns are invoked by I<mpx_free> before the remaining
+connections are closed. Other threads must no longer call I<mpx_post>
+once I<mpx_free> has been invoked.
+
+Other sources of events, like pipes to helper processes, timer
+or signal file descriptors, can be monitored by the event loop
+of I<mpx> as well. I<mpx_watch_fd> registers I<fd> with the
+event engine such that I<handler> is invoked with I<mpx>, I<fd>,
+the ready events, and I<arg> whenever one of I<events>
+(B<POLLIN> and/or B<POLLOUT>) is ready. Errors and hangups are
+reported as B<POLLERR> and B<POLLHUP>, respectively, even if they
+were not asked for. As I<fd> is monitored in level-triggered mode,
+the handler is invoked again in the next iteration if it did not
+consume all input. It should operate in non-blocking mode and cope
+with spurious wakeups. I<mpx_watch_fd> returns a watch which is
+to be passed to I<mpx_unwatch_fd> to stop monitoring I<fd>, or null
+in case of errors. Watched file descriptors are neither closed by
+this module nor do they keep I<mpx_run> from returning when the
+listening socket has been given up and all connections are closed.
+Watches are taken from the same slot map as connections.
+I<mpx_unwatch_fd> may be called from within I<handler> and
+must be called before I<fd> is closed.
+
+Input handlers which need to keep unconsumed input between their
+invocations should not hold an input buffer for the whole lifetime of
+a connection as most connections are idle most of the time.
+Instead, they may borrow a buffer from a pool which is maintained
+by each multiplexor and return it as soon as all of its input
+has been consumed. I<mpx_borrow_buffer> returns a buffer allocated
+by I<malloc> and stores its size in I<*size>, or null if it runs
+out of memory. The buffer may be resized by I<realloc>.
+I<mpx_return_buffer> takes it back, including its possibly changed
+I<size>. Buffers of the configured size are kept for reuse, all others
+are freed. I<mpx_set_buffer_pool> configures the size of the
+pooled buffers (4096 bytes by default) and the maximal number of
+unused buffers which are kept (64 by default).
+
+I<mpx_connect> opens an outbound connection to I<hp> (see
+L<hostport>) without blocking the event loop, e.g. to a backend
+or upstream server. The socket is put into non-blocking mode and
+returned as a connection of I<mpx> while I<connect> is still in
+progress. Its I<handle> field is initialized to I<handle> and it has
+its own handlers which are used in place of those of I<mpx>: as soon
+as the connection is established, I<open_handler> is invoked, if
+non-null, and afterwards the connection behaves like any accepted
+connection, i.e. I<read_from_link>, I<write_to_link> and all other
+functions operating on links can be used. Output which is queued
+before the connection is established is sent afterwards. If the
+connection cannot be established, just I<close_handler> is invoked, if
+non-null. The write timeout of I<mpx> limits the time for establishing
+the connection. I<mpx_connect> returns null with I<errno> set if the
+socket cannot be created or if I<connect> fails immediately. Outbound
+connections keep I<mpx_run> from returning as long as they exist.
+
+I<splice_links> pairs two connections of the same multiplexor such
+that all input of one connection is forwarded to the other one and
+vice versa. This is done under Linux by I<splice> through a pipe
+for each direction, i.e. without copying the data into user space.
+Each side reads not before the data it read last has been passed on
+completely such that slow receivers slow down their senders. The end
+of input is passed on by shutting down the writing side of the other
+connection. Both connections are closed as soon as the input of both
+has been forwarded completely, or as soon as one of them fails or is
+closed, including timeouts and I<close_link>. Output which has been
+queued before, e.g. by I<write_to_link>, is sent first. The input
+handlers are no longer invoked for spliced connections but their
+close handlers are invoked as usual. I<splice_links> returns B<false>
+with I<errno> set if the connections cannot be paired, in particular
+B<ENOSYS> on platforms without I<splice>.
+I<proxy_link> opens an outbound connection to I<hp> by
+I<mpx_connect> without any handlers and splices it with I<link>.
+It returns the new connection or null in case of failures where
+I<link> is left untouched. A transparent TCP proxy just needs
+to invoke I<proxy_link> from within its open handler.
+
 I<close_link> allows to shutdown the reading side of a connection,
 i.e. the input handler will no longer be called, just the pending
 list of response packets will be handled.
 
+Connections which are closed, either through I<close_link> or
+by the peer, are removed at the end of the current iteration
+of the event loop. Hence, the close handler is never invoked
+while another handler for the same connection is still running.
+
+Connections are kept in a slot map which is allocated in chunks
+of 256 connections such that the address of a connection remains
+stable during its lifetime and slots of terminated connections are
+reused. I<get_link_id> returns an id of I<link> which consists of its
+slot index and a generation number that is incremented whenever the
+slot is released. I<mpx_get_link> returns the connection of I<mpx>
+with the given I<id> or null if it no longer exists, i.e. after the
+close handler has been invoked. Ids are never 0 and are not reused
+until a slot has been reused 2^32 times. They are meant to be kept by
+objects that might survive the connection, like handlers
+submitted by I<mpx_post>. The event engines identify connections by
+their ids such that ready events can be mapped directly to their
+slots and events of connections which have been removed in the
+meantime are recognized and dropped.
+
+Each connection is registered just once with the underlying event
+engine and its set of monitored events is updated only if its
+state changes, i.e. when its output queue becomes empty or non-empty
+or when its reading side is closed. Under Linux, I<epoll> is used
+such that the costs of an iteration depend on the number of ready
+connections only. On other platforms, or if I<epoll_create1> fails,
+I<poll> is used on an array of I<pollfd> structures which is
+maintained incrementally and shares its index order with the
+slot map.
+
+I<run_multiplexor> is a shorthand for I<mpx_setup>, I<mpx_run>, and
+I<mpx_free>. I<mpx_setup> takes the same parameters as
+I<run_multiplexor> and returns a multiplexor which can be configured
+before I<mpx_run> runs its event loop. I<mpx_run> returns in case of
+errors only, or when all listening sockets have failed and all
+connections have terminated. I<mpx_free> releases the multiplexor
+after I<mpx_run> returned and closes all remaining connections,
+invoking the close handler for each of them.
+
+I<mpx_setup_sockets> works like I<mpx_setup> but accepts connections
+from all I<nsockets> listening I<sockets>, e.g. one for each address
+returned by I<get_all_hostports> (see L<hostport>), such that a single
+event loop serves IPv4, IPv6, and UNIX domain sockets or several
+interfaces at once. Each listening socket is given up individually
+if I<accept> fails. With no sockets at all, I<mpx_run> serves just
+the links created by I<mpx_connect> and returns when they and all
+timers are gone. I<get_link_listener> returns the index into
+I<sockets> of the listening socket which accepted I<link>, i.e. 0 for
+multiplexors created by I<mpx_setup>, or -1 for outbound links.
+
+I<run_multiplexor_mt> runs I<nthreads> multiplexors in separate threads
+which share the listening I<socket>. If I<nthreads> is 0, the number
+returned by I<get_hardware_concurrency> (see L<concurrency>) is taken.
+Each new connection is accepted by just one of the multiplexors which then owns it for its
+entire lifetime. Hence, all handler invocations for one connection
+come from the same thread and never run concurrently. Handlers of
+different connections, however, may run in parallel and must
+synchronize their accesses to the I<mpx_handle> object, if necessary.
+I<run_multiplexor_mt> returns as soon as all multiplexors have
+terminated.
+
+I<mpx_set_engine> selects the event engine to be used by I<mpx_run>.
+By default (B<MPX_ENGINE_DEFAULT>), I<epoll> is taken where available
+and I<poll> otherwise. B<MPX_ENGINE_IO_URING> selects an engine under
+Linux which is based on I<io_uring>: new connections are taken by one
+multishot accept request, pending output packets are passed to the
+kernel as send requests, and these requests are submitted in batches
+together with the poll requests of all connections when waiting for
+the next completions. Input is still read by I<read_from_link> once
+it has been reported by a poll request as the input handler supplies
+the buffer, and file ranges are still sent by I<sendfile> or I<splice>
+when the socket becomes writable. If the kernel does not support
+I<io_uring> or lacks multishot accept requests (Linux 5.19 or later
+is required), I<mpx_run> falls back to the default engine.
+I<mpx_set_engine> returns B<false> if the engine is not supported on
+this platform. I<mpx_get_engine> returns the engine which has
+been selected or, while I<mpx_run> is running, the engine in use.
+
 =head1 AUTHOR
 
 Andreas F. Borchert
@@ -119,228 +543,2969 @@ Andreas F. Borchert
 
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* needed for accept4 */
+#endif
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#include <afblib/concurrency.h>
+#include <afblib/hostport.h>
 #include <afblib/multiplexor.h>
+#include <afblib/slab.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#define HAVE_EPOLL
+#define HAVE_EVENTFD
+#define HAVE_SENDFILE
+#define HAVE_SPLICE
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#define HAVE_ZEROCOPY
+#endif
+#define HAVE_ACCEPT4
+#if defined(__NR_io_uring_setup) && defined(IORING_ACCEPT_MULTISHOT)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef __FreeBSD__
+#define HAVE_ACCEPT4
+#endif
+
+#ifndef IOV_MAX
+#ifdef UIO_MAXIOV
+#define IOV_MAX UIO_MAXIOV
+#else
+#define IOV_MAX 16 /* minimal value required by POSIX */
+#endif
+#endif
+
+#define EPOLL_BATCH 64 /* maximal number of events per epoll_wait */
+#define ACCEPT_BUDGET 64 /* maximal number of accepts per iteration */
+#define ACCEPT_BACKOFF 50 /* pause in ms if accept runs out of resources */
+#define URING_ENTRIES 256 /* size of the submission queue */
+#define URING_IOV 64 /* maximal number of packets per send request */
+#define SLOT_CHUNK 256 /* number of connection slots allocated at once */
+#define FILE_CHUNK 65536 /* copied at once from files without sendfile */
+#define SPLICE_CHUNK 65536 /* moved at once between spliced links */
+#define SHED_INTERVAL 10 /* max wait in ms while shedding load */
+#define PIPE_MAX_DELAY 32 /* maximal delay in ms for empty pipes */
+#define ZEROCOPY_MAX_DELAY 32 /* maximal delay in ms for lingering links */
+#define URING_MAX_DELAY 32 /* maximal delay in ms for half-closed links */
+#define ZEROCOPY_LINGER 2000 /* max wait in ms for MSG_ZEROCOPY at the end */
+#define BUFFER_SIZE 4096 /* default size of pooled read buffers */
+#define BUFFER_POOL 64 /* default number of unused pooled buffers */
+#define ARENA_CHUNK 4096 /* minimal size of the chunks of output arenas */
+#define ARENA_COPY 512 /* max size of packets copied by write_to_link */
+
+/* tokens which identify the event sources other than connections;
+   connections are identified by their ids which are >= 2^32 */
+#define TOKEN_NOTIFIER 0 /* wakeup through mpx_post */
+#define TOKEN_LISTENER 1 /* first listening socket, followed by the others */
+
+#define SLOT_MASK (((uint64_t) 1 << 32) - 1)
+#define GENERATION ((uint64_t) 1 << 32)
+
+/* hierarchical timer wheel with a resolution of 1 ms where each
+   of the levels covers 64 times the range of the level below;
+   timers beyond its range of about 4.6 hours are cascaded repeatedly */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+typedef struct timer_wheel {
+   uint64_t current; /* next tick (in ms) to be processed */
+   mpx_timer* slots[WHEEL_LEVELS][WHEEL_SIZE];
+   uint64_t occupied[WHEEL_LEVELS]; /* bitmaps of non-empty slots */
+   size_t count; /* number of pending timers */
+} timer_wheel;
+
+typedef struct output_buffer {
+   char* buf;
+   size_t len;
+   atomic_size_t refcount;
+} output_buffer;
 
 typedef struct output_queue_member {
    char* buf;
    size_t len;
    size_t pos;
+   output_buffer* shared; /* non-null if buf belongs to a shared buffer */
+   int fd; /* file to be sent instead of buf if non-negative */
+   off_t offset; /* of the file range */
+   bool pipe; /* fd is a pipe */
+   size_t size; /* of arena chunks which follow the member, 0 otherwise */
+   bool zerocopy; /* sent by MSG_ZEROCOPY, at least partially */
+   uint32_t zcfirst, zclast; /* ids of the MSG_ZEROCOPY sends of this member */
+   uint32_t zcpending; /* number of these sends which are not completed yet */
    struct output_queue_member* next;
 } output_queue_member;
 
-typedef struct multiplexor {
-   /* parameters passed to run_multiplexor */
+/* arena chunk of the default size */
+typedef struct arena_chunk {
+   output_queue_member member;
+   char buf[ARENA_CHUNK];
+} arena_chunk;
+
+static slab_cache member_cache =
+   SLAB_CACHE_INITIALIZER("output_queue_member", output_queue_member);
+static slab_cache chunk_cache =
+   SLAB_CACHE_INITIALIZER("arena_chunk", arena_chunk);
+
+#ifdef HAVE_IO_URING
+/* user_data values of requests besides the tokens */
+#define URING_IGNORE ((uint64_t) 1 << 31) /* completions of update and
+					     cancel requests */
+/* or'ed to the token of a listening socket for its poll requests */
+#define URING_POLL ((uint64_t) 1 << 30)
+/* or'ed to the id of a connection for its send requests */
+#define URING_SEND ((uint64_t) 1 << 29)
+
+/* submission and completion rings of io_uring, see io_uring(7) */
+typedef struct uring {
+   int fd;
+   void* sq_ring; size_t sq_ring_size;
+   void* cq_ring; size_t cq_ring_size;
+   struct io_uring_sqe* sqes; size_t sqes_size;
+   unsigned* sq_head; unsigned* sq_tail; unsigned* sq_mask;
+   unsigned* sq_array;
+   unsigned* cq_head; unsigned* cq_tail; unsigned* cq_mask;
+   struct io_uring_cqe* cqes;
+   unsigned sq_entries;
+   unsigned pending; /* number of queued but not yet submitted entries */
+} uring;
+
+/* message of a send request which must remain valid until the
+   request has been submitted; the packets it refers to are kept
+   in the output queue until the request completes */
+typedef struct send_request {
+   struct msghdr msg;
+   struct iovec iov[URING_IOV];
+   bool zerocopy; /* sent by MSG_ZEROCOPY */
+} send_request;
+
+static slab_cache send_cache =
+   SLAB_CACHE_INITIALIZER("send_request", send_request);
+#endif
+
+/* file descriptor monitored by mpx_watch_fd */
+struct mpx_watch {
+   mpx_watch_handler handler;
+   void* arg;
+   connection* slot; /* slot of the slot map taken by this watch */
+};
+
+/* unused read buffer which is kept by the pool */
+typedef struct pooled_buffer {
+   struct pooled_buffer* next;
+} pooled_buffer;
+
+/* listening socket passed to mpx_setup or mpx_setup_sockets */
+typedef struct listener {
    int socket;
+   uint64_t token; /* TOKEN_LISTENER + index into the listeners */
+   bool ok; /* becomes false when accept() fails */
+} listener;
+
+/* handler submitted by mpx_post */
+typedef struct posted_handler {
+   mpx_post_handler handler;
+   void* arg;
+   struct posted_handler* next;
+} posted_handler;
+
+typedef struct multiplexor {
+   /* parameters passed to mpx_setup */
+   listener* listeners;
+   size_t nlisteners;
    multiplexor_handler ohandler, ihandler, chandler;
    void* mpx_handle;
+   /* default watermarks of new connections */
+   size_t high_watermark, low_watermark;
+   /* default timeouts of new connections */
+   unsigned int idle_timeout, read_timeout, write_timeout;
+   size_t zerocopy_threshold; /* minimal size for MSG_ZEROCOPY, 0 if off */
+   /* load shedding, see mpx_set_shedding */
+   uint64_t max_lag; /* in us, 0 if off */
+   mpx_shedding shedding_policy;
+   bool paused; /* listening sockets are not monitored while shedding */
+   /* listening sockets are not monitored until accept_timer expires */
+   bool backoff;
+   mpx_timer accept_timer;
+   /* default read budget of new connections */
+   size_t read_budget;
+   unsigned int read_calls;
    /* additional administrative fields */
-   bool socketok; /* becomes false when accept() fails */
-   connection* head; /* double-linked linear list of connections */
-   connection* tail; /* its last element */
+   size_t listening; /* number of listeners which are still ok */
+   int spare_fd; /* released to reject connections if we run out of fds */
+   connection** chunks; /* slot map of connections */
+   size_t nchunks; /* number of allocated chunks */
+   connection* free_slots; /* linear list of unused slots */
+   connection* removed; /* linear list of links to be removed */
+   /* ids of links which exhausted their read budget;
+      stale ids of links which are gone in the meantime are skipped */
+   mpx_link_id* ready;
+   size_t nready; /* number of used entries of ready */
+   size_t readylen; /* allocated len of ready */
+   /* pool of read buffers, see mpx_borrow_buffer */
+   pooled_buffer* buffers; /* linear list of unused buffers */
+   size_t nbuffers; /* number of unused buffers */
+   size_t buffer_size; /* size of pooled buffers */
+   size_t max_buffers; /* maximal number of unused buffers */
    size_t count; /* number of connections */
+   mpx_engine engine;
+   bool running; /* event engine has been set up by mpx_run */
+   uint64_t now; /* time in ms, updated once per iteration */
+   uint64_t woken; /* time in us when the last wait for events ended */
+   mpx_load load;
+   bool stats_enabled; /* handler latencies are recorded */
+   mpx_stats stats;
+   timer_wheel timers;
+   /* queue of handlers submitted by mpx_post from other threads */
+   pthread_mutex_t post_mutex;
+   posted_handler* post_head; /* protected by post_mutex */
+   posted_handler* post_tail; /* protected by post_mutex */
+   bool post_notified; /* protected by post_mutex */
+   int notify_fds[2]; /* eventfd (twice) or pipe waking up the loop */
+   /* fields of the poll engine */
    struct pollfd* pollfds; /* parameter for poll() */
    size_t pollfdslen; /* allocated len of pollfds */
-   connection** pollcs; /* of the same len as pollfds */
+   size_t npollfds; /* number of used entries of pollfds */
+   /* index into pollfds of the first connection slot
+      as the tokens are used as indices for the other sources */
+   size_t poll_offset;
+#ifdef HAVE_EPOLL
+   /* fields of the epoll engine */
+   int epfd;
+   struct epoll_event epoll_events[EPOLL_BATCH];
+#endif
+#ifdef HAVE_IO_URING
+   /* fields of the io_uring engine */
+   uring ring;
+   size_t sends; /* number of pending send requests */
+#endif
 } multiplexor;
 
-/* remove a connection from the double-linked linear
-   list of connections
-*/
-static void remove_link(multiplexor* mpx, connection* link) {
-   close(link->fd);
-   if (link->prev) {
-      link->prev->next = link->next;
-   } else {
-      mpx->head = link->next;
+static connection* slot_link(multiplexor* mpx, size_t slot) {
+   return &mpx->chunks[slot / SLOT_CHUNK][slot % SLOT_CHUNK];
+}
+
+/* return the slot which is currently identified by id,
+   be it a connection or a watched file descriptor */
+static connection* find_slot(multiplexor* mpx, uint64_t id) {
+   size_t slot = id & SLOT_MASK;
+   if (slot >= mpx->nchunks * SLOT_CHUNK) return 0;
+   connection* link = slot_link(mpx, slot);
+   if ((!link->used && !link->watch) || link->id != id) return 0;
+   return link;
+}
+
+/* return the listener identified by token, if any */
+static listener* find_listener(multiplexor* mpx, uint64_t token) {
+   if (token < TOKEN_LISTENER || token - TOKEN_LISTENER >= mpx->nlisteners) {
+      return 0;
    }
-   if (link->next) {
-      link->next->prev = link->prev;
-   } else {
-      mpx->tail = link->prev;
-   }
-   if (mpx->chandler) (*mpx->chandler)(link);
-   free(link);
-   --mpx->count;
-}
-
-/* prepare fields pollfds and pollfdslen in mpx in
-   dependence of the current set of connections */
-static size_t setup_polls(multiplexor* mpx) {
-   size_t len = mpx->count;
-   if (mpx->socketok) ++len;
-   if (len == 0) return 0;
-   /* weed out links which have been closed
-      and where our output queue is empty */
-   connection* link = mpx->head;
-   while (link) {
-      connection* next = link->next;
-      if (link->eof && link->oqhead == 0) remove_link(mpx, link);
-      link = next;
-   }
-   /* allocate or enlarge pollfds, if necessary */
-   if (mpx->pollfdslen < len) {
-      mpx->pollfds = realloc(mpx->pollfds, sizeof(struct pollfd) * len);
-      if (mpx->pollfds == 0) return 0;
-      mpx->pollcs = realloc(mpx->pollcs, sizeof(connection*) * len);
-      if (mpx->pollcs == 0) return 0;
-      mpx->pollfdslen = len;
-   }
-   size_t index = 0;
-   /* look for new network connections as long accept()
-      returned no errors so far */
-   if (mpx->socketok) {
-      mpx->pollcs[index] = 0;
-      mpx->pollfds[index++] = (struct pollfd) {mpx->socket, POLLIN};
-   }
-   /* look for incoming network connections and
-      check whether we can write any pending output packets
-      without blocking */
-   link = mpx->head;
-   while (link) {
-      short events = 0;
-      if (!link->eof) events |= POLLIN;
-      if (link->oqhead) events |= POLLOUT;
-      mpx->pollcs[index] = link;
-      mpx->pollfds[index++] = (struct pollfd) {link->fd, events};
-      link = link->next;
-   }
-   return index;
-}
-
-/* add a new connection to the double-linked linear
-   list of connections */
-static bool add_connection(multiplexor* mpx) {
-   int newfd;
-   if ((newfd = accept(mpx->socket, 0, 0)) < 0) {
-      mpx->socketok = false; return true;
-   }
-   connection* link = malloc(sizeof(connection));
-   if (link == 0) return false;
-   *link = (connection) {
-      .fd = newfd,
-      .handle = 0,
-      .mpx = mpx,
-      .mpx_handle = mpx->mpx_handle,
-      .eof = false,
-      .oqhead = 0, .oqtail = 0,
-      .next = 0, .prev = mpx->tail,
+   return &mpx->listeners[token - TOKEN_LISTENER];
+}
+
+#ifdef HAVE_EPOLL
+static uint32_t epoll_events_of(short events) {
+   uint32_t result = 0;
+   if (events & POLLIN) result |= EPOLLIN;
+   if (events & POLLOUT) result |= EPOLLOUT;
+   return result;
+}
+
+static short poll_events_of(uint32_t events) {
+   short result = 0;
+   if (events & EPOLLIN) result |= POLLIN;
+   if (events & EPOLLOUT) result |= POLLOUT;
+   if (events & EPOLLERR) result |= POLLERR;
+   if (events & EPOLLHUP) result |= POLLHUP;
+   return result;
+}
+#endif
+
+#ifdef HAVE_IO_URING
+static int uring_enter(uring* ring, unsigned to_submit,
+      unsigned min_complete, unsigned flags) {
+   return syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+      flags, 0, 0);
+}
+
+/* check whether all operations we need are supported;
+   IORING_OP_SOCKET is used as indicator for Linux 5.19
+   which introduced multishot accept requests */
+static bool uring_probe(uring* ring) {
+   size_t size = sizeof(struct io_uring_probe) +
+      256 * sizeof(struct io_uring_probe_op);
+   struct io_uring_probe* probe = calloc(1, size);
+   if (!probe) return false;
+   bool ok = syscall(__NR_io_uring_register, ring->fd,
+	 IORING_REGISTER_PROBE, probe, 256) >= 0;
+   int ops[] = {IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE,
+      IORING_OP_ACCEPT, IORING_OP_ASYNC_CANCEL, IORING_OP_SENDMSG,
+      IORING_OP_SOCKET};
+   for (int i = 0; ok && i < sizeof ops / sizeof ops[0]; ++i) {
+      ok = ops[i] <= probe->last_op &&
+	 (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+   }
+   free(probe);
+   return ok;
+}
+
+/* submit all queued requests and wait for at least one completion
+   but not longer than timeout ms if it is non-negative */
+static int uring_wait(uring* ring, int timeout) {
+   if (timeout < 0) {
+      return uring_enter(ring, ring->pending, 1, IORING_ENTER_GETEVENTS);
+   }
+   struct __kernel_timespec ts = {
+      .tv_sec = timeout / 1000,
+      .tv_nsec = timeout % 1000 * 1000000L,
    };
-   if (mpx->tail) {
-      mpx->tail->next = link;
-   } else {
-      mpx->head = link;
+   struct io_uring_getevents_arg arg = {.ts = (uintptr_t) &ts};
+   return syscall(__NR_io_uring_enter, ring->fd, ring->pending, 1,
+      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+}
+
+static bool uring_init(uring* ring) {
+   struct io_uring_params params = {0};
+   ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+   if (ring->fd < 0) return false;
+   if (!(params.features & IORING_FEAT_NODROP) ||
+	 !(params.features & IORING_FEAT_EXT_ARG) || !uring_probe(ring)) {
+      close(ring->fd); return false;
    }
-   mpx->tail = link;
-   ++mpx->count;
-   if (mpx->ohandler) (*mpx->ohandler)(link);
+   ring->sq_entries = params.sq_entries;
+   ring->sq_ring_size = params.sq_off.array +
+      params.sq_entries * sizeof(unsigned);
+   ring->cq_ring_size = params.cq_off.cqes +
+      params.cq_entries * sizeof(struct io_uring_cqe);
+   ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+   ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+   ring->sqes = mmap(0, ring->sqes_size, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+   if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+	 ring->sqes == MAP_FAILED) {
+      if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+      if (ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+      if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+      close(ring->fd); return false;
+   }
+   char* sq = ring->sq_ring;
+   ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+   ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+   ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+   ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+   char* cq = ring->cq_ring;
+   ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+   ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+   ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+   ring->pending = 0;
    return true;
 }
 
-/* read one input packet from the given network connection */
-ssize_t read_from_link(connection* link, char* buf, size_t len) {
-   if (link->eof) return 0;
-   ssize_t nbytes = read(link->fd, buf, len);
-   if (nbytes <= 0) {
-      link->eof = true;
-      if (link->oqhead == 0) remove_link(link->mpx, link);
+static void uring_free(uring* ring) {
+   munmap(ring->sq_ring, ring->sq_ring_size);
+   munmap(ring->cq_ring, ring->cq_ring_size);
+   munmap(ring->sqes, ring->sqes_size);
+   close(ring->fd);
+}
+
+/* return the next free submission queue entry;
+   queued entries are submitted if the queue is full */
+static struct io_uring_sqe* uring_get_sqe(uring* ring) {
+   unsigned tail = *ring->sq_tail;
+   while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+	 ring->sq_entries) {
+      int submitted = uring_enter(ring, ring->pending, 0, 0);
+      if (submitted <= 0) return 0;
+      ring->pending -= submitted;
    }
-   return nbytes;
+   unsigned index = tail & *ring->sq_mask;
+   struct io_uring_sqe* sqe = &ring->sqes[index];
+   memset(sqe, 0, sizeof(struct io_uring_sqe));
+   ring->sq_array[index] = index;
+   __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+   ++ring->pending;
+   return sqe;
 }
 
-/* write one pending output packet to the given network connection */
-static void write_to_socket(multiplexor* mpx, connection* link) {
-   ssize_t nbytes = write(link->fd,
-      link->oqhead->buf + link->oqhead->pos,
-      link->oqhead->len - link->oqhead->pos);
-   if (nbytes <= 0) {
-      remove_link(mpx, link);
-   } else {
-      link->oqhead->pos += nbytes;
-      if (link->oqhead->pos == link->oqhead->len) {
-	 output_queue_member* old = link->oqhead;
-	 link->oqhead = old->next;
-	 if (link->oqhead == 0) {
-	    link->oqtail = 0;
-	 }
-	 free(old->buf); free(old);
-	 if (link->oqhead == 0 && link->eof) {
-	    remove_link(mpx, link);
-	 }
+/* queue a one-shot poll request for link */
+static bool uring_arm(multiplexor* mpx, connection* link) {
+   struct io_uring_sqe* sqe = uring_get_sqe(&mpx->ring);
+   if (!sqe) return false;
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = link->fd;
+   /* notifications of MSG_ZEROCOPY are signalled by POLLERR */
+   sqe->poll32_events = link->events | (link->zerocopy? POLLERR: 0);
+   sqe->user_data = link->id;
+   link->armed = true;
+   return true;
+}
+
+/* queue a multishot accept request for a listening socket */
+static bool uring_arm_socket(multiplexor* mpx, listener* listener) {
+   struct io_uring_sqe* sqe = uring_get_sqe(&mpx->ring);
+   if (!sqe) return false;
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = listener->socket;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+   sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+   sqe->user_data = listener->token;
+   return true;
+}
+
+/* queue a one-shot poll request for input on a file descriptor
+   which does not belong to a connection */
+static bool uring_poll(multiplexor* mpx, int fd, uint64_t user_data) {
+   struct io_uring_sqe* sqe = uring_get_sqe(&mpx->ring);
+   if (!sqe) return false;
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = fd;
+   sqe->poll32_events = POLLIN;
+   sqe->user_data = user_data;
+   return true;
+}
+
+/* queue a request which cancels or updates the request
+   identified by user_data */
+static bool uring_cancel(multiplexor* mpx, int opcode, uint64_t user_data,
+      unsigned flags, short events) {
+   struct io_uring_sqe* sqe = uring_get_sqe(&mpx->ring);
+   if (!sqe) return false;
+   sqe->opcode = opcode;
+   sqe->fd = -1;
+   sqe->addr = user_data;
+   sqe->len = flags;
+   sqe->poll32_events = events;
+   sqe->user_data = URING_IGNORE;
+   return true;
+}
+#endif
+
+#ifdef HAVE_IO_URING
+static void uring_drain(multiplexor* mpx);
+#endif
+
+/* initialize the selected event engine, falling back to
+   epoll or poll if it is not available */
+static void engine_init(multiplexor* mpx) {
+#ifdef HAVE_IO_URING
+   if (mpx->engine == MPX_ENGINE_IO_URING) {
+      if (uring_init(&mpx->ring)) return;
+      mpx->engine = MPX_ENGINE_DEFAULT;
+   }
+#endif
+#ifdef HAVE_EPOLL
+   if (mpx->engine == MPX_ENGINE_DEFAULT ||
+	 mpx->engine == MPX_ENGINE_EPOLL) {
+      mpx->epfd = epoll_create1(EPOLL_CLOEXEC);
+      if (mpx->epfd >= 0) {
+	 mpx->engine = MPX_ENGINE_EPOLL; return;
       }
    }
+#endif
+   mpx->engine = MPX_ENGINE_POLL;
 }
 
-void run_multiplexor(int socket,
-      multiplexor_handler open_handler,
-      multiplexor_handler input_handler,
-      multiplexor_handler close_handler,
-      void* mpx_handle) {
-   /* ignore SIGPIPE as we might receive this signal
-      on writing to connections which were already
-      closed by our client */
-   struct sigaction sigact = {.sa_handler = SIG_IGN};
-   struct sigaction old_sigact = {0};
-   if (sigaction(SIGPIPE, &sigact, &old_sigact) < 0) return;
+static void engine_free(multiplexor* mpx) {
+   switch (mpx->engine) {
+#ifdef HAVE_EPOLL
+      case MPX_ENGINE_EPOLL:
+	 close(mpx->epfd);
+	 break;
+#endif
+#ifdef HAVE_IO_URING
+      case MPX_ENGINE_IO_URING:
+	 uring_drain(mpx);
+	 uring_free(&mpx->ring);
+	 break;
+#endif
+      default:
+	 break;
+   }
+   free(mpx->pollfds);
+   mpx->pollfds = 0;
+   mpx->pollfdslen = mpx->npollfds = 0;
+}
 
-   multiplexor mpx = {
-      .socket = socket,
-      .ohandler = open_handler,
-      .ihandler = input_handler,
-      .chandler = close_handler,
-      .mpx_handle = mpx_handle,
-      .socketok = true,
-   };
-   size_t count;
-   while ((count = setup_polls(&mpx)) > 0) {
-      if (poll(mpx.pollfds, count, -1) <= 0) return;
-      for (size_t index = 0; index < count; ++index) {
-	 if (mpx.pollfds[index].revents == 0) continue;
-	 int fd = mpx.pollfds[index].fd;
-	 if (fd == mpx.socket) {
-	    if (!add_connection(&mpx)) return;
-	 } else {
-	    connection* link = mpx.pollcs[index]; assert(link);
-	    if (mpx.pollfds[index].revents & POLLIN) {
-	       (*mpx.ihandler)(link);
+/* register fd with the event engine where token is either
+   one of the TOKEN_* values or the id of a connection */
+/* the engine functions are no-ops while the engine is not set up,
+   i.e. before and after mpx_run; links which exist when mpx_run
+   starts are added by add_slots */
+static bool engine_add(multiplexor* mpx, int fd, short events,
+      uint64_t token) {
+   if (!mpx->running) return true;
+   switch (mpx->engine) {
+#ifdef HAVE_EPOLL
+      case MPX_ENGINE_EPOLL: {
+	 struct epoll_event event = {
+	    .events = epoll_events_of(events),
+	    .data.u64 = token,
+	 };
+#ifdef EPOLLEXCLUSIVE
+	 /* wake up just one of the multiplexors sharing
+	    a listening socket */
+	 if (find_listener(mpx, token)) {
+	    event.events |= EPOLLEXCLUSIVE;
+	    if (epoll_ctl(mpx->epfd, EPOLL_CTL_ADD, fd, &event) >= 0) {
+	       return true;
 	    }
-	    if (mpx.pollfds[index].revents & POLLOUT) {
-	       write_to_socket(&mpx, link);
+	    event.events &= ~EPOLLEXCLUSIVE;
+	 }
+#endif
+	 return epoll_ctl(mpx->epfd, EPOLL_CTL_ADD, fd, &event) >= 0;
+      }
+#endif
+#ifdef HAVE_IO_URING
+      case MPX_ENGINE_IO_URING: {
+	 if (token == TOKEN_NOTIFIER) {
+	    return uring_poll(mpx, fd, TOKEN_NOTIFIER);
+	 }
+	 listener* listener = find_listener(mpx, token);
+	 if (listener) return uring_arm_socket(mpx, listener);
+	 return uring_arm(mpx, find_slot(mpx, token));
+      }
+#endif
+      default: {
+	 size_t index = token < mpx->poll_offset? token:
+	    mpx->poll_offset + (token & SLOT_MASK);
+	 /* allocate or enlarge pollfds, if necessary,
+	    where unused entries are ignored by poll() */
+	 if (index >= mpx->pollfdslen) {
+	    size_t len = mpx->pollfdslen? 2 * mpx->pollfdslen: 16;
+	    while (len <= index) len *= 2;
+	    struct pollfd* pollfds = realloc(mpx->pollfds,
+	       sizeof(struct pollfd) * len);
+	    if (pollfds == 0) return false;
+	    for (size_t i = mpx->pollfdslen; i < len; ++i) {
+	       pollfds[i] = (struct pollfd) {-1, 0};
 	    }
+	    mpx->pollfds = pollfds;
+	    mpx->pollfdslen = len;
 	 }
+	 mpx->pollfds[index] = (struct pollfd) {fd, events};
+	 if (index >= mpx->npollfds) mpx->npollfds = index + 1;
+	 return true;
       }
    }
+}
 
-   /* restore previous SIGPIPE handler */
-   sigaction(SIGPIPE, &old_sigact, 0);
+/* update the set of events we are interested in for link */
+static bool engine_modify(multiplexor* mpx, connection* link, short events) {
+   link->events = events;
+   if (!mpx->running) return true;
+   switch (mpx->engine) {
+#ifdef HAVE_EPOLL
+      case MPX_ENGINE_EPOLL: {
+	 struct epoll_event event = {
+	    .events = epoll_events_of(events),
+	    .data.u64 = link->id,
+	 };
+	 return epoll_ctl(mpx->epfd, EPOLL_CTL_MOD, link->fd, &event) >= 0;
+      }
+#endif
+#ifdef HAVE_IO_URING
+      case MPX_ENGINE_IO_URING:
+	 if (!link->armed) return uring_arm(mpx, link);
+	 return uring_cancel(mpx, IORING_OP_POLL_REMOVE, link->id,
+	    IORING_POLL_UPDATE_EVENTS, events | (link->zerocopy? POLLERR: 0));
+#endif
+      default:
+	 mpx->pollfds[mpx->poll_offset + link->index].events = events;
+	 return true;
+   }
 }
 
-bool write_to_link(connection* link, char* buf, size_t len) {
-   assert(len >= 0);
-   if (len == 0) {
-      free(buf); return true;
+/* deregister link; its slot must not be released before the end
+   of the iteration as pending events may still refer to it */
+static void engine_remove(multiplexor* mpx, connection* link) {
+   if (!mpx->running) return;
+   switch (mpx->engine) {
+#ifdef HAVE_EPOLL
+      case MPX_ENGINE_EPOLL:
+	 epoll_ctl(mpx->epfd, EPOLL_CTL_DEL, link->fd, 0);
+	 break;
+#endif
+#ifdef HAVE_IO_URING
+      case MPX_ENGINE_IO_URING:
+	 /* the completion of the cancelled request is
+	    dropped as it refers to an outdated id */
+	 if (link->armed) {
+	    uring_cancel(mpx, IORING_OP_POLL_REMOVE, link->id, 0, 0);
+	    link->armed = false;
+	 }
+	 break;
+#endif
+      default:
+	 mpx->pollfds[mpx->poll_offset + link->index].fd = -1;
+	 /* trailing unused slots need not to be passed to poll() */
+	 while (mpx->npollfds > mpx->poll_offset &&
+	       mpx->pollfds[mpx->npollfds - 1].fd < 0) {
+	    --mpx->npollfds;
+	 }
+	 break;
    }
-   output_queue_member* member = malloc(sizeof(output_queue_member));
-   if (!member) return false;
-   member->buf = buf; member->len = len; member->pos = 0;
-   member->next = 0;
-   if (link->oqtail) {
-      link->oqtail->next = member;
+}
+
+/* stop monitoring a listening socket */
+static void engine_remove_socket(multiplexor* mpx, listener* listener) {
+   if (!mpx->running) return;
+   switch (mpx->engine) {
+#ifdef HAVE_EPOLL
+      case MPX_ENGINE_EPOLL:
+	 epoll_ctl(mpx->epfd, EPOLL_CTL_DEL, listener->socket, 0);
+	 break;
+#endif
+#ifdef HAVE_IO_URING
+      case MPX_ENGINE_IO_URING:
+	 uring_cancel(mpx, IORING_OP_ASYNC_CANCEL, listener->token, 0, 0);
+	 uring_cancel(mpx, IORING_OP_ASYNC_CANCEL,
+	    listener->token | URING_POLL, 0, 0);
+	 break;
+#endif
+      default:
+	 /* negative file descriptors are ignored by poll() */
+	 mpx->pollfds[listener->token].fd = -1;
+	 break;
+   }
+}
+
+/* current time in milliseconds */
+static uint64_t current_time(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* current time in microseconds */
+static uint64_t current_usec(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* current time in nanoseconds */
+static uint64_t current_nsec(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* values below 8 have their own bucket, larger values share
+   one of four buckets per power of two */
+static size_t histogram_bucket(uint64_t value) {
+   if (value < 8) return value;
+   int exp = 63 - __builtin_clzll(value);
+   return 4 * (exp - 1) + ((value >> (exp - 2)) & 3);
+}
+
+static uint64_t bucket_limit(size_t bucket) {
+   if (bucket < 8) return bucket;
+   int exp = bucket / 4 + 1;
+   uint64_t width = (uint64_t) 1 << (exp - 2);
+   return (4 + bucket % 4) * width + width - 1;
+}
+
+static void record_latency(mpx_histogram* histogram, uint64_t latency) {
+   ++histogram->count;
+   histogram->sum += latency;
+   if (latency > histogram->max) histogram->max = latency;
+   ++histogram->buckets[histogram_bucket(latency)];
+}
+
+/* invoke a handler and record its latency if asked for */
+static void invoke_handler(multiplexor* mpx, multiplexor_handler handler,
+      connection* link, mpx_histogram* histogram) {
+   if (!mpx->stats_enabled) {
+      (*handler)(link); return;
+   }
+   uint64_t start = current_nsec();
+   (*handler)(link);
+   record_latency(histogram, current_nsec() - start);
+}
+
+static void wheel_insert(timer_wheel* wheel, mpx_timer* timer) {
+   uint64_t deadline = timer->deadline;
+   if (deadline < wheel->current) deadline = wheel->current;
+   uint64_t delta = deadline - wheel->current;
+   int level = 0;
+   while (level < WHEEL_LEVELS - 1 &&
+	 delta >> (WHEEL_BITS * (level + 1))) {
+      ++level;
+   }
+   /* timers beyond the range of the wheel are inserted
+      into the farthest slot and reinserted on cascading */
+   uint64_t range = (uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS);
+   if (delta >= range) deadline = wheel->current + range - 1;
+   int slot = (deadline >> (WHEEL_BITS * level)) & WHEEL_MASK;
+   timer->level = level; timer->slot = slot;
+   timer->prev = 0; timer->next = wheel->slots[level][slot];
+   if (timer->next) timer->next->prev = timer;
+   wheel->slots[level][slot] = timer;
+   wheel->occupied[level] |= (uint64_t) 1 << slot;
+   timer->active = true;
+   ++wheel->count;
+}
+
+static void wheel_remove(timer_wheel* wheel, mpx_timer* timer) {
+   if (timer->prev) {
+      timer->prev->next = timer->next;
    } else {
-      link->oqhead = member;
+      wheel->slots[timer->level][timer->slot] = timer->next;
+      if (!timer->next) {
+	 wheel->occupied[timer->level] &= ~((uint64_t) 1 << timer->slot);
+      }
    }
-   link->oqtail = member;
-   return true;
+   if (timer->next) timer->next->prev = timer->prev;
+   timer->active = false;
+   --wheel->count;
 }
 
-void close_link(connection* link) {
+/* redistribute the timers of the higher-level slots
+   which are due when the given tick is reached */
+static void wheel_cascade(timer_wheel* wheel, uint64_t tick) {
+   for (int level = 1; level < WHEEL_LEVELS; ++level) {
+      int slot = (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+      mpx_timer* timer = wheel->slots[level][slot];
+      wheel->slots[level][slot] = 0;
+      wheel->occupied[level] &= ~((uint64_t) 1 << slot);
+      while (timer) {
+	 mpx_timer* next = timer->next;
+	 --wheel->count;
+	 wheel_insert(wheel, timer);
+	 timer = next;
+      }
+      if (slot) break;
+   }
+}
+
+/* distance from slot start to the next non-empty slot;
+   bits must not be 0 */
+static int next_slot(uint64_t bits, int start) {
+   start &= WHEEL_MASK;
+   if (start) bits = (bits >> start) | (bits << (WHEEL_SIZE - start));
+   return __builtin_ctzll(bits);
+}
+
+/* invoke the handlers of all timers which are due at mpx->now */
+static void run_timers(multiplexor* mpx) {
+   timer_wheel* wheel = &mpx->timers;
+   while (wheel->current <= mpx->now) {
+      uint64_t tick = wheel->current;
+      int slot = tick & WHEEL_MASK;
+      if (slot == 0) wheel_cascade(wheel, tick);
+      /* timers which are added by the handlers
+	 for this tick are run as well */
+      while (wheel->slots[0][slot]) {
+	 mpx_timer* timer = wheel->slots[0][slot];
+	 wheel_remove(wheel, timer);
+	 (*timer->handler)(mpx, timer->arg);
+	 if (timer->allocated) free(timer);
+      }
+      /* skip empty slots up to the next cascade */
+      uint64_t next = (tick | WHEEL_MASK) + 1;
+      if (wheel->count == 0) {
+	 next = mpx->now + 1;
+      } else if (slot < WHEEL_MASK) {
+	 uint64_t bits = wheel->occupied[0] >> (slot + 1);
+	 if (bits) next = tick + 1 + __builtin_ctzll(bits);
+      }
+      if (next > mpx->now + 1) next = mpx->now + 1;
+      wheel->current = next;
+   }
+}
+
+/* return the timeout in ms for the next wait for events,
+   -1 if there are no pending timers; it may end before the
+   next deadline when the timers of a higher level are to be
+   cascaded */
+static int next_timeout(multiplexor* mpx) {
+   timer_wheel* wheel = &mpx->timers;
+   if (wheel->count == 0) return -1;
+   uint64_t deadline = UINT64_MAX;
+   for (int level = 0; level < WHEEL_LEVELS; ++level) {
+      if (!wheel->occupied[level]) continue;
+      int shift = WHEEL_BITS * level;
+      uint64_t tick;
+      if (level == 0) {
+	 tick = wheel->current +
+	    next_slot(wheel->occupied[0], wheel->current & WHEEL_MASK);
+      } else {
+	 /* time of the next cascade of a non-empty slot of this level */
+	 uint64_t index = wheel->current >> shift;
+	 if (wheel->current & (((uint64_t) 1 << shift) - 1)) ++index;
+	 tick = (index + next_slot(wheel->occupied[level], index)) << shift;
+      }
+      if (tick < deadline) deadline = tick;
+   }
+   if (deadline <= mpx->now) return 0;
+   if (deadline - mpx->now > INT_MAX) return INT_MAX;
+   return deadline - mpx->now;
+}
+
+/* events we are currently interested in for the given link */
+static short wanted_events(connection* link) {
+   /* a socket becomes writable when connect() completes */
+   if (link->connecting) return POLLOUT;
+   short events = 0;
+   if (link->peer) {
+      /* read only if the previous input has been passed on */
+      if (!link->eof && link->piped == 0) events |= POLLIN;
+      if (link->oqhead || link->peer->piped) events |= POLLOUT;
+      return events;
+   }
+   if (!link->eof && !link->throttled) events |= POLLIN;
+   if (link->oqhead && !link->pipe_retry && !link->send) events |= POLLOUT;
+   return events;
+}
+
+/* take an unused slot of the slot map, extending it if necessary */
+static connection* allocate_slot(multiplexor* mpx) {
+   if (!mpx->free_slots) {
+      connection** chunks = realloc(mpx->chunks,
+	 sizeof(connection*) * (mpx->nchunks + 1));
+      if (!chunks) return 0;
+      mpx->chunks = chunks;
+      connection* chunk = malloc(sizeof(connection) * SLOT_CHUNK);
+      if (!chunk) return 0;
+      chunks[mpx->nchunks] = chunk;
+      /* lower slots are taken first */
+      for (size_t i = SLOT_CHUNK; i-- > 0; ) {
+	 size_t slot = mpx->nchunks * SLOT_CHUNK + i;
+	 chunk[i] = (connection) {
+	    .id = GENERATION | slot,
+	    .index = slot,
+	    .next = mpx->free_slots,
+	 };
+	 mpx->free_slots = &chunk[i];
+      }
+      ++mpx->nchunks;
+   }
+   connection* link = mpx->free_slots;
+   mpx->free_slots = link->next;
+   return link;
+}
+
+/* return a slot to the list of unused slots and invalidate
+   the id of the connection which used it */
+static void release_slot(multiplexor* mpx, connection* link) {
+   link->used = false;
+   link->id += GENERATION;
+   if (link->id < GENERATION) link->id += GENERATION;
+   link->next = mpx->free_slots;
+   mpx->free_slots = link;
+}
+
+/* move a connection to the list of links which are to be
+   removed at the end of the current iteration */
+static void schedule_removal(multiplexor* mpx, connection* link) {
+   if (link->removed) return;
+   link->removed = true;
+   link->next = mpx->removed;
+   mpx->removed = link;
+}
+
+/* spliced link has forwarded all its input to its peer */
+static bool splice_done(connection* link) {
+   return link->eof && link->piped == 0 && link->shut_peer &&
+      link->oqhead == 0;
+}
+
+static bool has_timeouts(connection* link) {
+   return link->idle_timeout || link->read_timeout || link->write_timeout;
+}
+
+/* earliest time at which one of the timeouts of link expires
+   unless there is some progress in the meantime, 0 if none applies */
+static uint64_t link_deadline(connection* link) {
+   /* lingering links are checked until ZEROCOPY_LINGER expires */
+   if (link->zclinger) return link->zcretry;
+   uint64_t deadline = UINT64_MAX;
+   if (link->idle_timeout) {
+      deadline = link->last_activity + link->idle_timeout;
+   }
+   if (link->read_timeout && !link->eof && !link->throttled &&
+	 !link->connecting && !(link->peer && link->piped) &&
+	 link->last_read + link->read_timeout < deadline) {
+      deadline = link->last_read + link->read_timeout;
+   }
+   if (link->write_timeout && (link->oqhead || link->connecting ||
+	    (link->peer && link->peer->piped)) &&
+	 link->last_write + link->write_timeout < deadline) {
+      deadline = link->last_write + link->write_timeout;
+   }
+   if (link->pipe_retry && link->pipe_retry < deadline) {
+      deadline = link->pipe_retry;
+   }
+   if (link->uring_retry && link->uring_retry < deadline) {
+      deadline = link->uring_retry;
+   }
+   return deadline == UINT64_MAX? 0: deadline;
+}
+
+/* make sure that the timer of link expires not later than
+   its earliest deadline; a timer which expires too early is
+   simply rescheduled such that progress on a link does not
+   require any operations on the timer wheel */
+static void schedule_link_timer(multiplexor* mpx, connection* link) {
+   uint64_t deadline = link_deadline(link);
+   if (link->timer.active) {
+      if (deadline && link->timer.deadline <= deadline) return;
+      wheel_remove(&mpx->timers, &link->timer);
+   }
+   if (deadline) {
+      link->timer.deadline = deadline;
+      wheel_insert(&mpx->timers, &link->timer);
+   }
+}
+
+static void discard_output(connection* link);
+#ifdef HAVE_IO_URING
+static bool sends_output(connection* link);
+static bool uring_send(multiplexor* mpx, connection* link, bool zerocopy);
+#endif
+
+#ifdef HAVE_ZEROCOPY
+static bool complete_zerocopy(multiplexor* mpx, connection* link);
+static void release_retained(connection* link);
+
+/* check the error queue of a lingering link once more; its
+   retained packets are given up if the peer hung up or if
+   the notifications did not arrive within ZEROCOPY_LINGER ms */
+static void check_lingering(multiplexor* mpx, connection* link) {
+   complete_zerocopy(mpx, link);
+   if (!link->zchead || link->removed) return;
+   struct pollfd pollfd = {link->fd, 0};
+   bool hangup = poll(&pollfd, 1, 0) > 0 && (pollfd.revents & POLLHUP);
+   if (hangup || link->zclinger <= mpx->now) {
+      release_retained(link);
+      schedule_removal(mpx, link);
+      return;
+   }
+   link->zcdelay = link->zcdelay? 2 * link->zcdelay: 1;
+   if (link->zcdelay > ZEROCOPY_MAX_DELAY) {
+      link->zcdelay = ZEROCOPY_MAX_DELAY;
+   }
+   link->zcretry = mpx->now + link->zcdelay;
+   schedule_link_timer(mpx, link);
+}
+
+/* a link which is done except for packets still used by
+   the kernel is no longer polled as POLLHUP and POLLERR
+   would be reported continuously; instead its timer checks
+   the error queue in growing intervals */
+static void linger(multiplexor* mpx, connection* link) {
+   if (link->zclinger) return;
+   engine_remove(mpx, link);
+   link->events = 0;
+   link->zclinger = mpx->now + ZEROCOPY_LINGER;
+   link->zcdelay = 0;
+   check_lingering(mpx, link);
+}
+
+/* resume polling for a lingering link which got new output */
+static bool unlinger(multiplexor* mpx, connection* link, short events) {
+   link->zclinger = 0;
+   link->events = events;
+   return engine_add(mpx, link->fd, events, link->id);
+}
+#endif
+
+/* make the set of monitored events consistent with the state of link */
+static void update_events(multiplexor* mpx, connection* link) {
+   if (link->removed) return;
+   /* stop reading while the output queue exceeds the high watermark
+      and resume when it is drained down to the low watermark */
+   if (link->high_watermark) {
+      if (link->oqbytes > link->high_watermark) {
+	 link->throttled = true;
+      } else if (link->oqbytes <= link->low_watermark) {
+	 link->throttled = false;
+      }
+   }
+   bool done;
+   if (link->peer) {
+      /* spliced links are removed together */
+      done = splice_done(link) && splice_done(link->peer);
+   } else {
+      done = link->eof && link->oqhead == 0 && link->zchead == 0;
+   }
+   if (done) {
+      schedule_removal(mpx, link);
+#ifdef HAVE_ZEROCOPY
+   } else if (link->eof && link->oqhead == 0 && !link->peer) {
+      linger(mpx, link);
+#endif
+   } else {
+#ifdef HAVE_IO_URING
+      if (sends_output(link) && !uring_send(mpx, link, true)) {
+	 discard_output(link);
+	 link->eof = true; schedule_removal(mpx, link);
+	 return;
+      }
+#endif
+      short events = wanted_events(link);
+#ifdef HAVE_ZEROCOPY
+      if (link->zclinger) {
+	 if (!unlinger(mpx, link, events)) {
+	    link->eof = true; schedule_removal(mpx, link);
+	 } else {
+	    schedule_link_timer(mpx, link);
+	 }
+	 return;
+      }
+#endif
+      if (events == link->events) return;
+      short added = events & ~link->events;
+      if (!engine_modify(mpx, link, events)) {
+	 link->eof = true; schedule_removal(mpx, link);
+      } else if (has_timeouts(link)) {
+	 /* waiting for input or output progress starts now
+	    unless we are still waiting for an empty pipe */
+	 if (added & POLLIN) link->last_read = mpx->now;
+	 if ((added & POLLOUT) && !link->pipe_delay) {
+	    link->last_write = mpx->now;
+	 }
+	 schedule_link_timer(mpx, link);
+      }
+   }
+}
+
+/* release an output packet which is no longer needed */
+static void free_member(output_queue_member* member) {
+   if (member->fd >= 0) {
+      close(member->fd);
+   } else if (member->shared) {
+      release_output_buffer(member->shared);
+   } else if (!member->size) {
+      free(member->buf);
+   }
+   if (member->size == ARENA_CHUNK) {
+      slab_free(&chunk_cache, member);
+   } else if (member->size) {
+      free(member);
+   } else {
+      slab_free(&member_cache, member);
+   }
+}
+
+/* keep a packet which has been sent by MSG_ZEROCOPY
+   until the kernel no longer needs it */
+static void retain_member(connection* link, output_queue_member* member) {
+   if (member->zcpending == 0) {
+      free_member(member); return;
+   }
+   member->next = 0;
+   if (link->zctail) {
+      link->zctail->next = member;
+   } else {
+      link->zchead = member;
+   }
+   link->zctail = member;
+}
+
+/* discard all pending output packets of link */
+static void discard_output(connection* link) {
+#ifdef HAVE_IO_URING
+   if (link->send) {
+      /* the packets are still used by the pending send request
+	 and released when it is completed, see complete_send */
+      if (!link->discarded) {
+	 link->discarded = true;
+	 uring_cancel(link->mpx, IORING_OP_ASYNC_CANCEL,
+	    link->id | URING_SEND, 0, 0);
+      }
+      return;
+   }
+#endif
+   while (link->oqhead) {
+      output_queue_member* old = link->oqhead;
+      link->oqhead = old->next;
+      retain_member(link, old);
+   }
+   link->oqtail = 0;
+   link->oqbytes = 0;
+   link->blocked = false;
+}
+
+/* release all packets sent by MSG_ZEROCOPY regardless
+   whether the kernel still needs them */
+static void release_retained(connection* link) {
+   while (link->zchead) {
+      output_queue_member* old = link->zchead;
+      link->zchead = old->next;
+      free_member(old);
+   }
+   link->zctail = 0;
+}
+
+/* invoked when the earliest deadline of link might be reached;
+   connections which timed out are given up together with
+   their pending output */
+static void link_timeout(multiplexor* mpx, void* arg) {
+   connection* link = arg;
+   if (link->removed) return;
+#ifdef HAVE_ZEROCOPY
+   if (link->zclinger) {
+      if (link->zcretry <= mpx->now) check_lingering(mpx, link);
+      else schedule_link_timer(mpx, link);
+      return;
+   }
+#endif
+#ifdef HAVE_IO_URING
+   if (link->uring_retry && link->uring_retry <= mpx->now) {
+      link->uring_retry = 0;
+      if (!link->armed && !uring_arm(mpx, link)) {
+	 discard_output(link);
+	 link->eof = true; schedule_removal(mpx, link);
+	 return;
+      }
+   }
+#endif
+   if (link->pipe_retry && link->pipe_retry <= mpx->now) {
+      /* wait for the socket to become writable again */
+      link->pipe_retry = 0;
+      update_events(mpx, link);
+      if (link->removed) return;
+   }
+   uint64_t deadline = link_deadline(link);
+   if (deadline == 0) return;
+   if (deadline > mpx->now) {
+      schedule_link_timer(mpx, link);
+   } else {
+      discard_output(link);
+      link->eof = true;
+      schedule_removal(mpx, link);
+   }
+}
+
+/* dissolve the pairing of a spliced link which is to be removed;
+   its peer is closed as well */
+static void unsplice(multiplexor* mpx, connection* link) {
+   connection* peer = link->peer;
+   for (int i = 0; i < 2; ++i) {
+      close(link->pipefds[i]); close(peer->pipefds[i]);
+   }
+   link->peer = peer->peer = 0;
+   link->piped = peer->piped = 0;
+   discard_output(peer);
+   peer->eof = true;
+   schedule_removal(mpx, peer);
+}
+
+/* remove all links which have been scheduled for removal;
+   links which got new output in the meantime are kept
+   until their output queue is drained, and links with
+   packets sent by MSG_ZEROCOPY until their notifications
+   arrived as the kernel might still access these packets */
+static void reap_links(multiplexor* mpx) {
+   while (mpx->removed) {
+      connection* link = mpx->removed;
+      mpx->removed = link->next;
+      link->removed = false;
+      if (link->watch) {
+	 /* deregistered already by mpx_unwatch_fd */
+	 free(link->watch); link->watch = 0;
+	 release_slot(mpx, link);
+	 continue;
+      }
+      if (link->oqhead || link->zchead) {
+	 update_events(mpx, link);
+	 schedule_link_timer(mpx, link);
+	 continue;
+      }
+      if (link->peer) unsplice(mpx, link);
+      if (link->timer.active) wheel_remove(&mpx->timers, &link->timer);
+      engine_remove(mpx, link);
+      close(link->fd);
+      if (link->chandler) {
+	 invoke_handler(mpx, link->chandler, link, &mpx->stats.close_latency);
+      }
+      discard_output(link);
+      --mpx->count;
+      release_slot(mpx, link);
+   }
+}
+
+/* initialize the slot of a new connection with the defaults of mpx */
+static void init_link(multiplexor* mpx, connection* link, int fd,
+      short events) {
+   *link = (connection) {
+      .fd = fd,
+      .used = true,
+      .events = events,
+      .id = link->id,
+      .index = link->index,
+      .handle = 0,
+      .mpx = mpx,
+      .mpx_handle = mpx->mpx_handle,
+      .listener = -1,
+      .ihandler = mpx->ihandler,
+      .chandler = mpx->chandler,
+      .eof = false,
+      .removed = false,
+      .oqhead = 0, .oqtail = 0,
+      .high_watermark = mpx->high_watermark,
+      .low_watermark = mpx->low_watermark,
+      .read_budget = mpx->read_budget,
+      .read_calls = mpx->read_calls,
+      .idle_timeout = mpx->idle_timeout,
+      .read_timeout = mpx->read_timeout,
+      .write_timeout = mpx->write_timeout,
+      .last_activity = mpx->now,
+      .last_read = mpx->now,
+      .last_write = mpx->now,
+      .timer = {.handler = link_timeout, .arg = link},
+   };
+#ifdef HAVE_ZEROCOPY
+   if (mpx->zerocopy_threshold) {
+      int one = 1;
+      link->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY,
+	 &one, sizeof one) == 0;
+   }
+#endif
+}
+
+/* add a new connection to the slot map */
+static bool add_connection(multiplexor* mpx, listener* listener,
+      int newfd) {
+   if (mpx->load.shedding && mpx->shedding_policy == MPX_SHED_REJECT) {
+      close(newfd); ++mpx->load.rejected; ++mpx->stats.rejected;
+      return true;
+   }
+   connection* link = allocate_slot(mpx);
+   if (link == 0) {
+      close(newfd); ++mpx->stats.accept_failures; return false;
+   }
+   init_link(mpx, link, newfd, POLLIN);
+   link->listener = listener->token - TOKEN_LISTENER;
+   if (!engine_add(mpx, newfd, POLLIN, link->id)) {
+      close(newfd); release_slot(mpx, link);
+      ++mpx->stats.accept_failures; return false;
+   }
+   ++mpx->stats.accepts; ++mpx->count;
+   schedule_link_timer(mpx, link);
+   if (mpx->ohandler) {
+      invoke_handler(mpx, mpx->ohandler, link, &mpx->stats.open_latency);
+   }
+   return true;
+}
+
+static bool set_nonblocking(int fd) {
+   int flags = fcntl(fd, F_GETFL);
+   return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+/* create the file descriptors through which other threads
+   wake up the event loop */
+static bool notifier_init(multiplexor* mpx) {
+#ifdef HAVE_EVENTFD
+   int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (fd < 0) return false;
+   mpx->notify_fds[0] = mpx->notify_fds[1] = fd;
+   return true;
+#else
+   if (pipe(mpx->notify_fds) < 0) return false;
+   for (int i = 0; i < 2; ++i) {
+      if (!set_nonblocking(mpx->notify_fds[i]) ||
+	    fcntl(mpx->notify_fds[i], F_SETFD, FD_CLOEXEC) < 0) {
+	 close(mpx->notify_fds[0]); close(mpx->notify_fds[1]);
+	 return false;
+      }
+   }
+   return true;
+#endif
+}
+
+static void notifier_free(multiplexor* mpx) {
+   close(mpx->notify_fds[0]);
+   if (mpx->notify_fds[1] != mpx->notify_fds[0]) close(mpx->notify_fds[1]);
+}
+
+static void notify(multiplexor* mpx) {
+#ifdef HAVE_EVENTFD
+   uint64_t value = 1;
+#else
+   char value = 0;
+#endif
+   /* failures can be ignored as the pipe is still readable if full */
+   if (write(mpx->notify_fds[1], &value, sizeof value) < 0) return;
+}
+
+/* invoke all handlers which have been posted so far */
+static bool posts_pending(multiplexor* mpx) {
+   pthread_mutex_lock(&mpx->post_mutex);
+   bool pending = mpx->post_head != 0;
+   pthread_mutex_unlock(&mpx->post_mutex);
+   return pending;
+}
+
+static void run_posted_handlers(multiplexor* mpx) {
+   char buf[64];
+   while (read(mpx->notify_fds[0], buf, sizeof buf) > 0);
+   pthread_mutex_lock(&mpx->post_mutex);
+   posted_handler* posted = mpx->post_head;
+   mpx->post_head = mpx->post_tail = 0;
+   mpx->post_notified = false;
+   pthread_mutex_unlock(&mpx->post_mutex);
+   while (posted) {
+      posted_handler* next = posted->next;
+      (*posted->handler)(mpx, posted->arg);
+      free(posted);
+      posted = next;
+   }
+}
+
+/* accept a connection in non-blocking and close-on-exec mode */
+static int accept_nonblocking(int socket) {
+#ifdef HAVE_ACCEPT4
+   return accept4(socket, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+   int fd = accept(socket, 0, 0);
+   if (fd >= 0 && (!set_nonblocking(fd) ||
+	 fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)) {
+      close(fd); fd = -1;
+   }
+   return fd;
+#endif
+}
+
+/* errors of accept() which concern a single connection only,
+   including pending network errors which are passed on by Linux */
+static bool transient_accept_error(int error) {
+   switch (error) {
+      case EINTR:
+      case ECONNABORTED:
+      case EPROTO:
+      case EPERM:
+      case ENETDOWN:
+      case ENETUNREACH:
+      case EHOSTDOWN:
+      case EHOSTUNREACH:
+      case ENOPROTOOPT:
+      case EOPNOTSUPP:
+#ifdef ENONET
+      case ENONET:
+#endif
+	 return true;
+      default:
+	 return false;
+   }
+}
+
+/* we ran out of file descriptors: take the next pending connection
+   with the help of our spare file descriptor and close it right away
+   such that the listening socket does not remain ready */
+static void reject_connection(multiplexor* mpx, listener* listener) {
+   close(mpx->spare_fd);
+   int fd = accept(listener->socket, 0, 0);
+   if (fd >= 0) {
+      close(fd); ++mpx->stats.rejected;
+   }
+   mpx->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* listening sockets are monitored unless we are shedding
+   load or backing off */
+static bool accepting(multiplexor* mpx) {
+   return !mpx->paused && !mpx->backoff;
+}
+
+/* start or stop monitoring all listening sockets which are ok */
+static void monitor_listeners(multiplexor* mpx, bool monitor) {
+   for (size_t i = 0; i < mpx->nlisteners; ++i) {
+      listener* listener = &mpx->listeners[i];
+      if (!listener->ok) continue;
+      if (!monitor) {
+	 engine_remove_socket(mpx, listener);
+      } else if (!engine_add(mpx, listener->socket, POLLIN,
+	    listener->token)) {
+	 listener->ok = false; --mpx->listening;
+      }
+   }
+}
+
+/* resume accepting when the backoff is over */
+static void end_backoff(multiplexor* mpx, void* arg) {
+   mpx->backoff = false;
+   if (mpx->spare_fd < 0) {
+      mpx->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+   }
+   if (accepting(mpx)) monitor_listeners(mpx, true);
+}
+
+/* stop accepting for ACCEPT_BACKOFF ms as accept() ran out of
+   file descriptors or memory and the listening sockets would
+   remain ready in the meantime */
+static void back_off(multiplexor* mpx) {
+   if (mpx->backoff) return;
+   if (accepting(mpx)) monitor_listeners(mpx, false);
+   mpx->backoff = true;
+   mpx->accept_timer = (mpx_timer) {
+      .deadline = mpx->now + ACCEPT_BACKOFF,
+      .handler = end_backoff,
+   };
+   wheel_insert(&mpx->timers, &mpx->accept_timer);
+}
+
+/* handle a failed accept(); false is returned if
+   further attempts are pointless within this iteration */
+static bool accept_failed(multiplexor* mpx, listener* listener,
+      int error) {
+   /* a non-blocking listening socket might be shared with
+      other multiplexors which took the connection before us */
+   if (error == EAGAIN || error == EWOULDBLOCK) return false;
+   ++mpx->stats.accept_failures;
+   if (transient_accept_error(error)) return true;
+   if ((error == EMFILE || error == ENFILE) && mpx->spare_fd >= 0) {
+      reject_connection(mpx, listener); return true;
+   }
+   if (error == EMFILE || error == ENFILE ||
+	 error == ENOBUFS || error == ENOMEM) {
+      back_off(mpx); return false;
+   }
+   listener->ok = false; --mpx->listening;
+   engine_remove_socket(mpx, listener);
+   return false;
+}
+
+/* accept pending connections from a listening socket */
+static bool accept_connections(multiplexor* mpx, listener* listener) {
+   for (int count = 0; count < ACCEPT_BUDGET && listener->ok; ++count) {
+      int newfd = accept_nonblocking(listener->socket);
+      if (newfd < 0) {
+	 if (!accept_failed(mpx, listener, errno)) break;
+      } else if (!add_connection(mpx, listener, newfd)) {
+	 return false;
+      }
+   }
+   return true;
+}
+
+static bool has_read_budget(connection* link) {
+   return link->read_budget || link->read_calls;
+}
+
+static bool read_budget_exhausted(connection* link) {
+   return (link->read_budget && link->bytes_read >= link->read_budget) ||
+      (link->read_calls && link->reads >= link->read_calls);
+}
+
+/* read one input packet from the given network connection */
+ssize_t read_from_link(connection* link, char* buf, size_t len) {
+   if (link->eof) return 0;
+   if (has_read_budget(link)) {
+      if (read_budget_exhausted(link)) {
+	 /* the link is served again by run_ready_links */
+	 errno = EAGAIN; return -1;
+      }
+      if (link->read_budget && len > link->read_budget - link->bytes_read) {
+	 len = link->read_budget - link->bytes_read;
+      }
+      ++link->reads;
+   }
+   ssize_t nbytes = read(link->fd, buf, len);
+   if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+	 errno == EINTR)) {
+      /* spurious wakeup, no input available yet */
+      link->drained = true;
+      return nbytes;
+   }
+   if (nbytes <= 0) {
+      link->eof = true;
+      update_events(link->mpx, link);
+   } else {
+      link->bytes_read += nbytes;
+      link->last_read = link->last_activity = link->mpx->now;
+      ++link->mpx->stats.reads; link->mpx->stats.bytes_in += nbytes;
+   }
+   return nbytes;
+}
+
+/* remember link to be read again in the next iteration */
+static void make_ready(multiplexor* mpx, connection* link) {
+   if (mpx->nready == mpx->readylen) {
+      size_t newlen = mpx->readylen? 2 * mpx->readylen: 16;
+      mpx_link_id* ready = realloc(mpx->ready, sizeof(mpx_link_id) * newlen);
+      /* not fatal as the event engine reports the link again */
+      if (!ready) return;
+      mpx->ready = ready; mpx->readylen = newlen;
+   }
+   mpx->ready[mpx->nready++] = link->id;
+   link->ready = true;
+}
+
+/* invoke the input handler of link, repeatedly if
+   link has a read budget and there is input left */
+static void read_input(multiplexor* mpx, connection* link) {
+   mpx_histogram* latency = &mpx->stats.input_latency;
+   if (!has_read_budget(link)) {
+      invoke_handler(mpx, link->ihandler, link, latency); return;
+   }
+   link->bytes_read = 0; link->reads = 0;
+   for(;;) {
+      unsigned int reads = link->reads;
+      link->drained = false;
+      invoke_handler(mpx, link->ihandler, link, latency);
+      if (link->drained || link->eof || link->removed || link->throttled) {
+	 return;
+      }
+      /* handlers which did not read are left to the event engine */
+      if (link->reads == reads) return;
+      if (read_budget_exhausted(link)) break;
+   }
+   make_ready(mpx, link);
+}
+
+/* serve the links which exhausted their read budget
+   in the previous iteration */
+static void run_ready_links(multiplexor* mpx) {
+   size_t count = mpx->nready;
+   if (count == 0) return;
+   for (size_t i = 0; i < count; ++i) {
+      connection* link = mpx_get_link(mpx, mpx->ready[i]);
+      if (!link) continue;
+      link->ready = false;
+      if (link->eof || link->removed || link->throttled ||
+	    link->peer) {
+	 continue;
+      }
+      read_input(mpx, link);
+   }
+   /* links which exhausted their budget once more
+      have been appended behind the processed entries */
+   mpx->nready -= count;
+   memmove(mpx->ready, mpx->ready + count,
+      sizeof(mpx_link_id) * mpx->nready);
+}
+
+/* the pipe at the head of the output queue of link ran empty:
+   stop waiting for the socket to become writable and try
+   again after a delay which grows while the pipe remains empty */
+static void wait_for_pipe(multiplexor* mpx, connection* link) {
+   link->pipe_delay = link->pipe_delay? 2 * link->pipe_delay: 1;
+   if (link->pipe_delay > PIPE_MAX_DELAY) link->pipe_delay = PIPE_MAX_DELAY;
+   link->pipe_retry = mpx->now + link->pipe_delay;
+   update_events(mpx, link);
+   schedule_link_timer(mpx, link);
+}
+
+#if !defined(HAVE_SPLICE) || !defined(HAVE_SENDFILE)
+/* copy the next chunk of the file range at the head of the output
+   queue of link into a new member in front of the range and send it */
+static ssize_t copy_file_chunk(multiplexor* mpx, connection* link) {
+   output_queue_member* member = link->oqhead;
+   size_t left = member->len - member->pos;
+   ssize_t nbytes;
+   if (left > FILE_CHUNK) left = FILE_CHUNK;
+   output_queue_member* chunk = slab_alloc(&member_cache);
+   char* buf = malloc(left);
+   if (!chunk || !buf) {
+      slab_free(&member_cache, chunk); free(buf); errno = ENOMEM; return -1;
+   }
+   if (member->pipe) {
+      nbytes = read(member->fd, buf, left);
+   } else {
+      nbytes = pread(member->fd, buf, left, member->offset + member->pos);
+   }
+   if (nbytes <= 0) {
+      int error = errno;
+      slab_free(&member_cache, chunk); free(buf);
+      if (nbytes < 0 && error == EAGAIN) wait_for_pipe(mpx, link);
+      errno = error; return nbytes;
+   }
+   *chunk = (output_queue_member) {.buf = buf, .len = nbytes, .fd = -1};
+   member->pos += nbytes;
+   if (member->pos == member->len) {
+      chunk->next = member->next;
+      if (link->oqtail == member) link->oqtail = chunk;
+      free_member(member);
+   } else {
+      chunk->next = member;
+   }
+   link->oqhead = chunk;
+   return write(link->fd, buf, nbytes);
+}
+#endif
+
+/* send the next part of the file range at the head
+   of the output queue of link */
+static ssize_t write_file(multiplexor* mpx, connection* link) {
+   output_queue_member* member = link->oqhead;
+   ssize_t nbytes;
+   if (member->pipe) {
+#ifdef HAVE_SPLICE
+      nbytes = splice(member->fd, 0, link->fd, 0, member->len - member->pos,
+	 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      int available = 0;
+      if (nbytes < 0 && errno == EAGAIN &&
+	    ioctl(member->fd, FIONREAD, &available) == 0 && available == 0) {
+	 wait_for_pipe(mpx, link); errno = EAGAIN;
+      }
+#else
+      nbytes = copy_file_chunk(mpx, link);
+#endif
+   } else {
+#ifdef HAVE_SENDFILE
+      off_t offset = member->offset + member->pos;
+      nbytes = sendfile(link->fd, member->fd, &offset,
+	 member->len - member->pos);
+#else
+      nbytes = copy_file_chunk(mpx, link);
+#endif
+   }
+   if (nbytes > 0) link->pipe_delay = 0;
+   return nbytes;
+}
+
+static bool use_zerocopy(connection* link, output_queue_member* member) {
+   return link->zerocopy && member->fd < 0 &&
+      member->len >= link->mpx->zerocopy_threshold;
+}
+
+#ifdef HAVE_ZEROCOPY
+/* account a send of the packet at the head of the output queue of
+   link by MSG_ZEROCOPY; each successful send consumes one id, and a
+   packet which is sent in multiple parts gets a contiguous range */
+static void count_zerocopy(connection* link) {
+   output_queue_member* member = link->oqhead;
+   if (!member->zerocopy) {
+      member->zerocopy = true;
+      member->zcfirst = link->zcnext;
+   }
+   member->zclast = link->zcnext++;
+   ++member->zcpending;
+}
+
+#ifdef HAVE_IO_URING
+/* undo count_zerocopy for a send which failed */
+static void uncount_zerocopy(connection* link) {
+   output_queue_member* member = link->oqhead;
+   if (member->zclast == member->zcfirst) {
+      member->zerocopy = false;
+   } else {
+      --member->zclast;
+   }
+   --link->zcnext;
+   --member->zcpending;
+}
+#endif
+
+/* send the packet at the head of the output queue of link
+   without copying it into the socket buffer */
+static ssize_t write_zerocopy(connection* link) {
+   output_queue_member* member = link->oqhead;
+   struct iovec iov = {
+      .iov_base = member->buf + member->pos,
+      .iov_len = member->len - member->pos,
+   };
+   struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+   ssize_t nbytes = sendmsg(link->fd, &msg, MSG_ZEROCOPY);
+   if (nbytes < 0 && errno == ENOBUFS) {
+      /* no memory left for the notification */
+      return writev(link->fd, &iov, 1);
+   }
+   if (nbytes > 0) count_zerocopy(link);
+   return nbytes;
+}
+
+/* return the number of ids from low to high which belong to member */
+static uint32_t count_completed(output_queue_member* member,
+      uint32_t low, uint32_t high) {
+   if (!member->zerocopy) return 0;
+   /* ids wrap around, hence we work relative to the first id of member */
+   uint64_t last = (uint32_t) (member->zclast - member->zcfirst);
+   uint64_t start = (uint32_t) (low - member->zcfirst);
+   uint64_t end = start + (uint32_t) (high - low);
+   if (start > last) {
+      /* the range may begin before the first id of member */
+      if (end < (uint64_t) 1 << 32) return 0;
+      start = 0; end -= (uint64_t) 1 << 32;
+   }
+   if (end > last) end = last;
+   return end - start + 1;
+}
+
+/* release the packets sent by MSG_ZEROCOPY for which the kernel
+   notified us through the error queue that it is done with them;
+   true is returned if any notification has been received */
+static bool complete_zerocopy(multiplexor* mpx, connection* link) {
+   char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+      sizeof(struct sockaddr_in6))];
+   bool notified = false;
+   for(;;) {
+      struct msghdr msg = {
+	 .msg_control = control,
+	 .msg_controllen = sizeof control,
+      };
+      if (recvmsg(link->fd, &msg, MSG_ERRQUEUE) < 0) break;
+      notified = true;
+      for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	 if (!(cmsg->cmsg_level == SOL_IP &&
+		  cmsg->cmsg_type == IP_RECVERR) &&
+	       !(cmsg->cmsg_level == SOL_IPV6 &&
+		  cmsg->cmsg_type == IPV6_RECVERR)) {
+	    continue;
+	 }
+	 struct sock_extended_err* error =
+	    (struct sock_extended_err*) CMSG_DATA(cmsg);
+	 if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+	 /* the ids from ee_info to ee_data are completed; the
+	    head of the output queue may still be partially unsent */
+	 uint32_t low = error->ee_info; uint32_t high = error->ee_data;
+	 if (link->oqhead) {
+	    link->oqhead->zcpending -=
+	       count_completed(link->oqhead, low, high);
+	 }
+	 output_queue_member** prev = &link->zchead;
+	 link->zctail = 0;
+	 while (*prev) {
+	    output_queue_member* member = *prev;
+	    member->zcpending -= count_completed(member, low, high);
+	    if (member->zcpending == 0) {
+	       *prev = member->next;
+	       free_member(member);
+	    } else {
+	       link->zctail = member;
+	       prev = &member->next;
+	    }
+	 }
+      }
+   }
+   if (!link->zchead) update_events(mpx, link);
+   return notified;
+}
+#endif
+
+/* gather the packets at the head of the output queue of link in
+   front of the next file range or the next packet to be sent by
+   MSG_ZEROCOPY; the number of entries stored in iov is returned */
+static int gather_output(connection* link, struct iovec* iov, int max) {
+   int iovcnt = 0;
+   for (output_queue_member* member = link->oqhead;
+	 member && member->fd < 0 && iovcnt < max &&
+	    (iovcnt == 0 || !use_zerocopy(link, member));
+	 member = member->next) {
+      iov[iovcnt++] = (struct iovec) {
+	 .iov_base = member->buf + member->pos,
+	 .iov_len = member->len - member->pos,
+      };
+   }
+   return iovcnt;
+}
+
+/* release all packets which have been written completely
+   by a write of the given number of bytes */
+static void consume_output(multiplexor* mpx, connection* link,
+      size_t written) {
+   link->oqbytes -= written;
+   link->last_write = link->last_activity = mpx->now;
+   ++mpx->stats.writes; mpx->stats.bytes_out += written;
+   while (written > 0) {
+      output_queue_member* member = link->oqhead;
+      size_t left = member->len - member->pos;
+      if (written < left) {
+	 member->pos += written; break;
+      }
+      written -= left;
+      link->oqhead = member->next;
+      retain_member(link, member);
+   }
+   if (link->oqhead == 0) {
+      link->oqtail = 0;
+      update_events(mpx, link);
+   } else if (link->throttled) {
+      update_events(mpx, link);
+#ifdef HAVE_IO_URING
+   } else if (sends_output(link)) {
+      /* packets behind a file range */
+      update_events(mpx, link);
+#endif
+   }
+}
+
+/* write as many pending output packets as possible
+   to the given network connection */
+static void write_to_socket(multiplexor* mpx, connection* link) {
+   ssize_t nbytes;
+   if (link->oqhead->fd >= 0) {
+      nbytes = write_file(mpx, link);
+#ifdef HAVE_ZEROCOPY
+   } else if (use_zerocopy(link, link->oqhead)) {
+      nbytes = write_zerocopy(link);
+#endif
+   } else {
+      struct iovec iov[IOV_MAX];
+      int iovcnt = gather_output(link, iov, IOV_MAX);
+      nbytes = writev(link->fd, iov, iovcnt);
+   }
+   if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+	 errno == EINTR)) {
+      return;
+   }
+   if (nbytes <= 0) {
+      discard_output(link);
+      link->eof = true;
+      schedule_removal(mpx, link);
+      return;
+   }
+   consume_output(mpx, link, nbytes);
+}
+
+#ifdef HAVE_IO_URING
+/* true if the output of link is to be passed to the kernel
+   as send request instead of waiting for POLLOUT; file ranges
+   and spliced links are still served by write_to_socket */
+static bool sends_output(connection* link) {
+   return link->mpx->running && link->mpx->engine == MPX_ENGINE_IO_URING &&
+      link->oqhead && link->oqhead->fd < 0 && !link->send &&
+      !link->blocked && !link->connecting && !link->peer;
+}
+
+/* queue a send request for the packets at the head of the output
+   queue of link; a packet which qualifies for MSG_ZEROCOPY is
+   sent alone with this flag unless zerocopy is false */
+static bool uring_send(multiplexor* mpx, connection* link, bool zerocopy) {
+   send_request* send = slab_alloc(&send_cache);
+   if (!send) return false;
+   struct io_uring_sqe* sqe = uring_get_sqe(&mpx->ring);
+   if (!sqe) {
+      slab_free(&send_cache, send); return false;
+   }
+   int flags = MSG_NOSIGNAL;
+   int iovcnt;
+   send->zerocopy = false;
+#ifdef HAVE_ZEROCOPY
+   if (zerocopy && use_zerocopy(link, link->oqhead)) {
+      /* the id is taken right now as the notification
+	 may be processed before the completion */
+      output_queue_member* member = link->oqhead;
+      send->iov[0] = (struct iovec) {
+	 .iov_base = member->buf + member->pos,
+	 .iov_len = member->len - member->pos,
+      };
+      iovcnt = 1;
+      flags |= MSG_ZEROCOPY;
+      send->zerocopy = true;
+      count_zerocopy(link);
+   } else
+#endif
+   {
+      iovcnt = gather_output(link, send->iov, URING_IOV);
+   }
+   send->msg = (struct msghdr) {.msg_iov = send->iov, .msg_iovlen = iovcnt};
+   sqe->opcode = IORING_OP_SENDMSG;
+   sqe->fd = link->fd;
+   sqe->addr = (uintptr_t) &send->msg;
+   sqe->len = 1;
+   sqe->msg_flags = flags;
+   sqe->user_data = link->id | URING_SEND;
+   link->send = send;
+   ++mpx->sends;
+   return true;
+}
+
+/* process the completion of the send request of link
+   which returned res */
+static void complete_send(multiplexor* mpx, connection* link, int res) {
+   bool zerocopy = link->send->zerocopy;
+   slab_free(&send_cache, link->send);
+   link->send = 0;
+   --mpx->sends;
+#ifdef HAVE_ZEROCOPY
+   if (zerocopy && res <= 0) uncount_zerocopy(link);
+#endif
+   if (link->discarded) {
+      link->discarded = false;
+      discard_output(link);
+      update_events(mpx, link);
+      return;
+   }
+   if (zerocopy && res == -ENOBUFS) {
+      /* no memory left for the notification */
+      if (mpx->running && !uring_send(mpx, link, false)) {
+	 discard_output(link);
+	 link->eof = true; schedule_removal(mpx, link);
+      }
+      return;
+   }
+   if (res == -EAGAIN) {
+      /* io_uring does not wait for non-blocking sockets,
+	 hence we poll for POLLOUT before we try again */
+      link->blocked = true;
+      update_events(mpx, link);
+      return;
+   }
+   if (res == -EINTR || res == -ECANCELED) {
+      update_events(mpx, link);
+      return;
+   }
+   if (res <= 0) {
+      discard_output(link);
+      link->eof = true; schedule_removal(mpx, link);
+      return;
+   }
+   consume_output(mpx, link, res);
+   /* send the rest, if any */
+   update_events(mpx, link);
+}
+
+/* cancel all pending send requests and wait for their completions
+   as the kernel must not access the output queues after the
+   engine has been shut down */
+static void uring_drain(multiplexor* mpx) {
+   if (mpx->sends == 0) return;
+   for (size_t slot = 0; slot < mpx->nchunks * SLOT_CHUNK; ++slot) {
+      connection* link = slot_link(mpx, slot);
+      if (link->send) {
+	 uring_cancel(mpx, IORING_OP_ASYNC_CANCEL, link->id | URING_SEND,
+	    0, 0);
+      }
+   }
+   uring* ring = &mpx->ring;
+   while (mpx->sends > 0) {
+      int submitted = uring_wait(ring, -1);
+      if (submitted < 0 && errno != EINTR) break;
+      if (submitted > 0) ring->pending -= submitted;
+      unsigned head = *ring->cq_head;
+      unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+      while (head != tail) {
+	 struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+	 __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+	 if (cqe.user_data == URING_IGNORE ||
+	       !(cqe.user_data & URING_SEND)) {
+	    continue;
+	 }
+	 connection* link = find_slot(mpx, cqe.user_data & ~URING_SEND);
+	 if (link && link->send) complete_send(mpx, link, cqe.res);
+      }
+   }
+   /* give up on requests which could not be waited for */
+   for (size_t slot = 0; mpx->sends > 0 &&
+	 slot < mpx->nchunks * SLOT_CHUNK; ++slot) {
+      connection* link = slot_link(mpx, slot);
+      if (link->send) complete_send(mpx, link, -ECANCELED);
+   }
+}
+#endif
+
+/* register all listening sockets with the event engine; they are
+   monitored as long as accept() returned no errors so far */
+static bool add_listeners(multiplexor* mpx) {
+   mpx->listening = 0;
+   for (size_t i = 0; i < mpx->nlisteners; ++i) {
+      listener* listener = &mpx->listeners[i];
+      listener->ok = false;
+      if (!set_nonblocking(listener->socket) ||
+	    !engine_add(mpx, listener->socket, POLLIN, listener->token)) {
+	 return false;
+      }
+      listener->ok = true; ++mpx->listening;
+   }
+   return true;
+}
+
+/* register the file descriptors which have been passed to
+   mpx_watch_fd or mpx_connect before the event engine was set up */
+static bool add_slots(multiplexor* mpx) {
+   for (size_t slot = 0; slot < mpx->nchunks * SLOT_CHUNK; ++slot) {
+      connection* link = slot_link(mpx, slot);
+      if ((!link->watch && !link->used) || link->removed) continue;
+      if (!engine_add(mpx, link->fd, link->events, link->id)) return false;
+   }
+   return true;
+}
+
+#ifdef HAVE_SPLICE
+/* move the input of link from its pipe to its peer */
+static bool splice_out(multiplexor* mpx, connection* link) {
+   connection* peer = link->peer;
+   /* wait for the connection and queued output of peer */
+   if (peer->connecting || peer->oqhead) return true;
+   while (link->piped > 0) {
+      ssize_t nbytes = splice(link->pipefds[0], 0, peer->fd, 0, link->piped,
+	 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (nbytes < 0) {
+	 if (errno == EINTR) continue;
+	 return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      link->piped -= nbytes;
+      peer->last_write = peer->last_activity = mpx->now;
+      ++mpx->stats.writes; mpx->stats.bytes_out += nbytes;
+   }
+   if (link->eof && !link->shut_peer) {
+      shutdown(peer->fd, SHUT_WR); link->shut_peer = true;
+   }
+   return true;
+}
+
+/* move the next input of link into its pipe */
+static bool splice_in(multiplexor* mpx, connection* link) {
+   ssize_t nbytes = splice(link->fd, 0, link->pipefds[1], 0, SPLICE_CHUNK,
+      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+   if (nbytes < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+   }
+   if (nbytes == 0) {
+      link->eof = true;
+   } else {
+      link->piped += nbytes;
+      link->last_read = link->last_activity = mpx->now;
+      ++mpx->stats.reads; mpx->stats.bytes_in += nbytes;
+   }
+   return true;
+}
+
+/* process the events reported for a spliced link */
+static void dispatch_spliced(multiplexor* mpx, connection* link,
+      short revents) {
+   connection* peer = link->peer;
+   bool ok = true;
+   if (revents & (POLLOUT|POLLHUP|POLLERR)) {
+      if (link->oqhead && !link->send) write_to_socket(mpx, link);
+      if (link->removed) return;
+      ok = splice_out(mpx, peer);
+   }
+   if (ok && (revents & (POLLIN|POLLHUP|POLLERR)) &&
+	 !link->eof && link->piped == 0) {
+      /* try to pass on the input right away */
+      ok = splice_in(mpx, link) && splice_out(mpx, link);
+   }
+   if (!ok) {
+      /* the peer is closed as well when link is removed */
+      discard_output(link);
+      link->eof = true; schedule_removal(mpx, link);
+      return;
+   }
+   update_events(mpx, link); update_events(mpx, peer);
+}
+#endif
+
+/* the pending connect() of link completed or failed */
+static void finish_connect(multiplexor* mpx, connection* link) {
+   int error = 0; socklen_t len = sizeof error;
+   if (getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+      error = errno;
+   }
+   link->connecting = false;
+   if (error) {
+      /* just the close handler is invoked */
+      discard_output(link);
+      link->eof = true; schedule_removal(mpx, link);
+      return;
+   }
+   link->last_read = link->last_write = link->last_activity = mpx->now;
+   if (link->ohandler && !link->eof) {
+      invoke_handler(mpx, link->ohandler, link, &mpx->stats.open_latency);
+   }
+   update_events(mpx, link);
+}
+
+/* process the events reported for one connection */
+static bool dispatch(multiplexor* mpx, connection* link, short revents) {
+   if (link->watch) {
+      if (!link->removed) {
+	 mpx_watch* watch = link->watch;
+	 (*watch->handler)(mpx, link->fd, revents, watch->arg);
+      }
+      return true;
+   }
+#ifdef HAVE_ZEROCOPY
+   if ((revents & POLLERR) && link->zerocopy &&
+	 complete_zerocopy(mpx, link)) {
+      /* POLLERR is also signalled for pending notifications, even
+	 for packets which are still partially unsent; actual errors
+	 are still noticed by read or write */
+      revents &= ~POLLERR;
+   }
+#endif
+   if (link->removed) return true;
+   if (link->connecting) {
+      if (!(revents & (POLLOUT|POLLHUP|POLLERR))) return true;
+      finish_connect(mpx, link);
+      if (link->removed) return true;
+   }
+#ifdef HAVE_SPLICE
+   if (link->peer) {
+      dispatch_spliced(mpx, link, revents); return true;
+   }
+#endif
+   /* links in the ready queue are read by run_ready_links */
+   if ((revents & (POLLIN|POLLHUP|POLLERR)) && !link->eof && !link->ready) {
+      read_input(mpx, link);
+   }
+#ifdef HAVE_IO_URING
+   if ((revents & (POLLOUT|POLLHUP|POLLERR)) && link->blocked &&
+	 !link->removed) {
+      /* try the send request again */
+      link->blocked = false;
+      update_events(mpx, link);
+   }
+#endif
+   if ((revents & (POLLOUT|POLLHUP|POLLERR)) &&
+	 link->oqhead && !link->send && !link->removed) {
+      write_to_socket(mpx, link);
+   }
+   return true;
+}
+
+/* process the events reported for the source identified by token */
+static bool dispatch_token(multiplexor* mpx, uint64_t token, short revents) {
+   if (token == TOKEN_NOTIFIER) {
+      run_posted_handlers(mpx);
+      return true;
+   }
+   listener* listener = find_listener(mpx, token);
+   if (listener) return accept_connections(mpx, listener);
+   connection* link = find_slot(mpx, token);
+   /* ignore events of connections which are gone */
+   if (!link) return true;
+   return dispatch(mpx, link, revents);
+}
+
+#ifdef HAVE_IO_URING
+/* process one completion of the io_uring engine */
+static bool process_completion(multiplexor* mpx, struct io_uring_cqe* cqe) {
+   if (cqe->user_data == URING_IGNORE) return true;
+   if (cqe->user_data == TOKEN_NOTIFIER) {
+      run_posted_handlers(mpx);
+      return uring_poll(mpx, mpx->notify_fds[0], TOKEN_NOTIFIER);
+   }
+   if (cqe->user_data & URING_SEND) {
+      connection* link = find_slot(mpx, cqe->user_data & ~URING_SEND);
+      if (link && link->send) complete_send(mpx, link, cqe->res);
+      return true;
+   }
+   if (cqe->user_data & URING_POLL) {
+      listener* listener = find_listener(mpx, cqe->user_data & ~URING_POLL);
+      if (!listener->ok || cqe->res == -ECANCELED) return true;
+      if (!accept_connections(mpx, listener)) return false;
+      return !listener->ok || !accepting(mpx) ||
+	 uring_arm_socket(mpx, listener);
+   }
+   listener* listener = find_listener(mpx, cqe->user_data);
+   if (listener) {
+      if (cqe->res < 0) {
+	 /* cancelled by engine_remove_socket */
+	 if (!listener->ok || cqe->res == -ECANCELED) return true;
+	 int error = -cqe->res;
+	 accept_failed(mpx, listener, error);
+	 if (!listener->ok || !accepting(mpx) ||
+	       (cqe->flags & IORING_CQE_F_MORE)) {
+	    return true;
+	 }
+	 /* multishot requests terminate in case of errors;
+	    as long as we are short of file descriptors, io_uring
+	    fails immediately even if no connection is pending,
+	    hence we fall back to a poll request in this case */
+	 if (error == EMFILE || error == ENFILE) {
+	    return uring_poll(mpx, listener->socket,
+	       listener->token | URING_POLL);
+	 }
+	 return uring_arm_socket(mpx, listener);
+      }
+      if (!(cqe->flags & IORING_CQE_F_MORE) && listener->ok &&
+	    accepting(mpx) && !uring_arm_socket(mpx, listener)) {
+	 return false;
+      }
+      return add_connection(mpx, listener, cqe->res);
+   }
+   connection* link = find_slot(mpx, cqe->user_data);
+   /* completions of cancelled requests of removed links */
+   if (!link) return true;
+   link->armed = false;
+   if (cqe->res == POLLRDHUP) {
+      /* POLLRDHUP is reported regardless of the requested events
+	 and persists once the peer shut down its side; hence a
+	 link which gets nothing else is armed again by its timer
+	 after a delay which grows as long as nothing else happens */
+      if (link->removed) return true;
+      link->uring_delay = link->uring_delay? 2 * link->uring_delay: 1;
+      if (link->uring_delay > URING_MAX_DELAY) {
+	 link->uring_delay = URING_MAX_DELAY;
+      }
+      link->uring_retry = mpx->now + link->uring_delay;
+      schedule_link_timer(mpx, link);
+      return true;
+   }
+   link->uring_delay = 0;
+   if (cqe->res > 0 && !dispatch(mpx, link, cqe->res)) return false;
+   /* re-arm the link unless this has been done already
+      by update_events while it was dispatched or it lingers */
+   if (!link->removed && !link->armed && !link->zclinger &&
+	 !uring_arm(mpx, link)) {
+      return false;
+   }
+   return true;
+}
+#endif
+
+/* wait for events, at most timeout ms if non-negative, and
+   process them; false is returned in case of errors */
+static bool process_events(multiplexor* mpx, int timeout) {
+   switch (mpx->engine) {
+#ifdef HAVE_EPOLL
+      case MPX_ENGINE_EPOLL: {
+	 int count = epoll_wait(mpx->epfd, mpx->epoll_events, EPOLL_BATCH,
+	    timeout);
+	 mpx->woken = current_usec(); ++mpx->stats.wakeups;
+	 if (count < 0) return false;
+	 for (int index = 0; index < count; ++index) {
+	    struct epoll_event* event = &mpx->epoll_events[index];
+	    if (!dispatch_token(mpx, event->data.u64,
+		  poll_events_of(event->events))) {
+	       return false;
+	    }
+	 }
+	 return true;
+      }
+#endif
+#ifdef HAVE_IO_URING
+      case MPX_ENGINE_IO_URING: {
+	 /* submit all queued requests and wait for completions */
+	 uring* ring = &mpx->ring;
+	 int submitted = uring_wait(ring, timeout);
+	 mpx->woken = current_usec(); ++mpx->stats.wakeups;
+	 if (submitted < 0 && errno == ETIME) submitted = 0;
+	 if (submitted < 0) return false;
+	 ring->pending -= submitted;
+	 unsigned head = *ring->cq_head;
+	 unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	 while (head != tail) {
+	    struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+	    __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+	    if (!process_completion(mpx, &cqe)) return false;
+	 }
+	 return true;
+      }
+#endif
+      default: {
+	 /* new connections may be added to pollfds while we
+	    are dispatching; their revents fields are still 0 */
+	 size_t count = mpx->npollfds;
+	 int ready = poll(mpx->pollfds, count, timeout);
+	 mpx->woken = current_usec(); ++mpx->stats.wakeups;
+	 if (ready < 0) return false;
+	 for (size_t index = 0; index < count; ++index) {
+	    short revents = mpx->pollfds[index].revents;
+	    if (revents == 0) continue;
+	    bool ok;
+	    if (index < mpx->poll_offset) {
+	       ok = dispatch_token(mpx, index, revents);
+	    } else {
+	       ok = dispatch(mpx, slot_link(mpx, index - mpx->poll_offset),
+		  revents);
+	    }
+	    if (!ok) return false;
+	 }
+	 return true;
+      }
+   }
+}
+
+/* start or stop shedding load depending on the loop lag */
+static void shed_load(multiplexor* mpx) {
+   bool shedding = mpx->load.shedding;
+   if (!mpx->max_lag || mpx->shedding_policy == MPX_SHED_NONE) {
+      shedding = false;
+   } else if (mpx->load.lag > mpx->max_lag) {
+      shedding = true;
+   } else if (mpx->load.lag <= mpx->max_lag / 2) {
+      shedding = false;
+   }
+   mpx->load.shedding = shedding;
+   bool pause = shedding && mpx->shedding_policy == MPX_SHED_PAUSE;
+   if (pause == mpx->paused || !mpx->listening) return;
+   mpx->paused = pause;
+   if (!mpx->backoff) monitor_listeners(mpx, !pause);
+}
+
+/* update the load statistics at the end of an iteration
+   which started at start (in us) */
+static void account_iteration(multiplexor* mpx, uint64_t start) {
+   uint64_t busy = current_usec() - mpx->woken;
+   ++mpx->load.iterations;
+   mpx->load.wait_time += mpx->woken - start;
+   mpx->load.busy_time += busy;
+   mpx->load.lag = (7 * mpx->load.lag + busy) / 8;
+   shed_load(mpx);
+}
+
+struct multiplexor* mpx_setup(int socket,
+      multiplexor_handler open_handler,
+      multiplexor_handler input_handler,
+      multiplexor_handler close_handler,
+      void* mpx_handle) {
+   return mpx_setup_sockets(&socket, 1, open_handler, input_handler,
+      close_handler, mpx_handle);
+}
+
+struct multiplexor* mpx_setup_sockets(const int* sockets, size_t nsockets,
+      multiplexor_handler open_handler,
+      multiplexor_handler input_handler,
+      multiplexor_handler close_handler,
+      void* mpx_handle) {
+   multiplexor* mpx = malloc(sizeof(multiplexor));
+   if (!mpx) return 0;
+   listener* listeners = 0;
+   if (nsockets > 0) {
+      listeners = calloc(nsockets, sizeof(listener));
+      if (!listeners) {
+	 free(mpx); return 0;
+      }
+   }
+   for (size_t i = 0; i < nsockets; ++i) {
+      listeners[i] = (listener) {
+	 .socket = sockets[i],
+	 .token = TOKEN_LISTENER + i,
+      };
+   }
+   *mpx = (multiplexor) {
+      .listeners = listeners,
+      .nlisteners = nsockets,
+      .poll_offset = TOKEN_LISTENER + nsockets,
+      .ohandler = open_handler,
+      .ihandler = input_handler,
+      .chandler = close_handler,
+      .mpx_handle = mpx_handle,
+      .engine = MPX_ENGINE_DEFAULT,
+      .buffer_size = BUFFER_SIZE,
+      .max_buffers = BUFFER_POOL,
+   };
+   mpx->now = mpx->timers.current = current_time();
+   if (!notifier_init(mpx)) {
+      free(listeners); free(mpx); return 0;
+   }
+   if (pthread_mutex_init(&mpx->post_mutex, 0)) {
+      notifier_free(mpx); free(listeners); free(mpx); return 0;
+   }
+   return mpx;
+}
+
+bool mpx_set_engine(struct multiplexor* mpx, mpx_engine engine) {
+   switch (engine) {
+      case MPX_ENGINE_DEFAULT:
+      case MPX_ENGINE_POLL:
+	 break;
+#ifdef HAVE_EPOLL
+      case MPX_ENGINE_EPOLL:
+	 break;
+#endif
+#ifdef HAVE_IO_URING
+      case MPX_ENGINE_IO_URING:
+	 break;
+#endif
+      default:
+	 return false;
+   }
+   mpx->engine = engine;
+   return true;
+}
+
+mpx_engine mpx_get_engine(struct multiplexor* mpx) {
+   return mpx->engine;
+}
+
+void mpx_run(struct multiplexor* mpx) {
+   /* ignore SIGPIPE as we might receive this signal
+      on writing to connections which were already
+      closed by our client */
+   struct sigaction sigact = {.sa_handler = SIG_IGN};
+   struct sigaction old_sigact = {0};
+   if (sigaction(SIGPIPE, &sigact, &old_sigact) < 0) return;
+
+   engine_init(mpx);
+   mpx->running = true;
+   mpx->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+   if (add_listeners(mpx) &&
+	 engine_add(mpx, mpx->notify_fds[0], POLLIN, TOKEN_NOTIFIER) &&
+	 add_slots(mpx)) {
+      mpx->now = current_time();
+      while (mpx->listening > 0 || mpx->count > 0 ||
+	    mpx->timers.count > 0) {
+	 /* do not wait if links are ready to be read */
+	 int timeout = mpx->nready? 0: next_timeout(mpx);
+	 /* the lag has to decay while we are shedding */
+	 if (mpx->load.shedding &&
+	       (timeout < 0 || timeout > SHED_INTERVAL)) {
+	    timeout = SHED_INTERVAL;
+	 }
+	 uint64_t start = current_usec();
+	 if (!process_events(mpx, timeout)) break;
+	 mpx->now = current_time();
+	 run_ready_links(mpx);
+	 run_timers(mpx);
+	 reap_links(mpx);
+	 account_iteration(mpx, start);
+      }
+      /* posted handlers may still use our connections which
+	 requires the engine to be present */
+      while (posts_pending(mpx)) {
+	 run_posted_handlers(mpx);
+      }
+   }
+   mpx->running = false;
+   engine_free(mpx);
+   if (mpx->spare_fd >= 0) close(mpx->spare_fd);
+
+   /* restore previous SIGPIPE handler */
+   sigaction(SIGPIPE, &old_sigact, 0);
+}
+
+/* close and release all remaining connections */
+void mpx_free(struct multiplexor* mpx) {
+   /* posted handlers may still refer to our connections */
+   while (posts_pending(mpx)) {
+      run_posted_handlers(mpx);
+   }
+   for (size_t slot = 0; slot < mpx->nchunks * SLOT_CHUNK; ++slot) {
+      connection* link = slot_link(mpx, slot);
+      free(link->watch);
+      if (!link->used) continue;
+      close(link->fd);
+      if (link->peer) {
+	 close(link->pipefds[0]); close(link->pipefds[1]);
+      }
+      if (link->chandler) (*link->chandler)(link);
+      discard_output(link);
+      release_retained(link);
+   }
+   /* release pending timers created by mpx_add_timer; this must
+      be done before the chunks are freed as the timers of the
+      links are embedded into them */
+   for (int level = 0; level < WHEEL_LEVELS; ++level) {
+      for (int slot = 0; slot < WHEEL_SIZE; ++slot) {
+	 mpx_timer* timer = mpx->timers.slots[level][slot];
+	 mpx->timers.slots[level][slot] = 0;
+	 while (timer) {
+	    mpx_timer* next = timer->next;
+	    if (timer->allocated) free(timer);
+	    timer = next;
+	 }
+      }
+   }
+   for (size_t i = 0; i < mpx->nchunks; ++i) {
+      free(mpx->chunks[i]);
+   }
+   free(mpx->chunks);
+   free(mpx->ready);
+   mpx_set_buffer_pool(mpx, mpx->buffer_size, 0);
+   notifier_free(mpx);
+   pthread_mutex_destroy(&mpx->post_mutex);
+   free(mpx->listeners);
+   free(mpx);
+}
+
+void run_multiplexor(int socket,
+      multiplexor_handler open_handler,
+      multiplexor_handler input_handler,
+      multiplexor_handler close_handler,
+      void* mpx_handle) {
+   multiplexor* mpx = mpx_setup(socket, open_handler, input_handler,
+      close_handler, mpx_handle);
+   if (!mpx) return;
+   mpx_run(mpx);
+   mpx_free(mpx);
+}
+
+struct mt_parameters {
+   int socket;
+   multiplexor_handler ohandler, ihandler, chandler;
+   void* mpx_handle;
+};
+
+static void* run_mt_multiplexor(void* arg) {
+   struct mt_parameters* pp = arg;
+   run_multiplexor(pp->socket, pp->ohandler, pp->ihandler, pp->chandler,
+      pp->mpx_handle);
+   return 0;
+}
+
+/* run nthreads multiplexors which share the given listening socket */
+void run_multiplexor_mt(int socket, unsigned int nthreads,
+      multiplexor_handler open_handler,
+      multiplexor_handler input_handler,
+      multiplexor_handler close_handler,
+      void* mpx_handle) {
+   if (nthreads == 0) nthreads = get_hardware_concurrency();
+   if (nthreads == 0) nthreads = 1;
+   /* SIGPIPE is ignored by every multiplexor but their
+      individual attempts to restore the previous handler
+      must not interfere with each other */
+   struct sigaction sigact = {.sa_handler = SIG_IGN};
+   struct sigaction old_sigact = {0};
+   if (sigaction(SIGPIPE, &sigact, &old_sigact) < 0) return;
+
+   struct mt_parameters parameters = {
+      .socket = socket,
+      .ohandler = open_handler,
+      .ihandler = input_handler,
+      .chandler = close_handler,
+      .mpx_handle = mpx_handle,
+   };
+   pthread_t threads[nthreads];
+   unsigned int started = 0;
+   while (started < nthreads && pthread_create(&threads[started], 0,
+	 run_mt_multiplexor, &parameters) == 0) {
+      ++started;
+   }
+   for (unsigned int i = 0; i < started; ++i) {
+      pthread_join(threads[i], 0);
+   }
+
+   sigaction(SIGPIPE, &old_sigact, 0);
+}
+
+/* append a member to the output queue of link */
+static void enqueue_member(connection* link, output_queue_member* member) {
+   if (link->oqtail) {
+      link->oqtail->next = member;
+   } else {
+      link->oqhead = member;
+   }
+   link->oqtail = member;
+   link->oqbytes += member->len;
+   update_events(link->mpx, link);
+}
+
+/* append a new output packet to the output queue of link */
+static bool enqueue(connection* link, char* buf, size_t len,
+      output_buffer* shared) {
+   output_queue_member* member = slab_alloc(&member_cache);
+   if (!member) return false;
+   *member = (output_queue_member) {
+      .buf = buf, .len = len, .pos = 0,
+      .shared = shared,
+      .fd = -1,
+   };
+   enqueue_member(link, member);
+   return true;
+}
+
+/* copy len bytes into the output arena of link, i.e. into the free
+   space of the last arena chunk of its output queue, if any, and
+   into a new chunk for the rest; chunks which have been passed to
+   the kernel by MSG_ZEROCOPY must not be touched anymore */
+static bool append_to_arena(connection* link, const char* buf, size_t len) {
+   output_queue_member* tail = link->oqtail;
+   size_t room = 0;
+   if (tail && tail->size && !tail->zerocopy) {
+      room = tail->size - tail->len;
+      if (room > len) room = len;
+   }
+   output_queue_member* member = 0;
+   if (len > room) {
+      size_t size = len - room > ARENA_CHUNK? len - room: ARENA_CHUNK;
+      if (size == ARENA_CHUNK) {
+	 member = slab_alloc(&chunk_cache);
+      } else {
+	 member = malloc(sizeof(output_queue_member) + size);
+      }
+      if (!member) return false;
+      *member = (output_queue_member) {
+	 .buf = (char*) (member + 1), .len = len - room, .pos = 0,
+	 .size = size,
+	 .fd = -1,
+      };
+      memcpy(member->buf, buf + room, len - room);
+   }
+   if (room > 0) {
+      memcpy(tail->buf + tail->len, buf, room);
+      tail->len += room;
+      link->oqbytes += room;
+   }
+   if (member) {
+      enqueue_member(link, member);
+   } else {
+      update_events(link->mpx, link);
+   }
+   return true;
+}
+
+bool write_to_link(connection* link, char* buf, size_t len) {
+   assert(len >= 0);
+   if (len == 0) {
+      free(buf); return true;
+   }
+   if (len <= ARENA_COPY) {
+      if (!append_to_arena(link, buf, len)) return false;
+      free(buf); return true;
+   }
+   return enqueue(link, buf, len, 0);
+}
+
+bool copy_to_link(connection* link, const char* buf, size_t len) {
+   if (len == 0) return true;
+   return append_to_arena(link, buf, len);
+}
+
+bool write_file_to_link(connection* link, int fd, off_t offset, size_t len) {
+   struct stat statbuf;
+   if (fstat(fd, &statbuf) < 0) return false;
+   bool pipe = S_ISFIFO(statbuf.st_mode);
+#ifndef HAVE_SPLICE
+   if (pipe && !set_nonblocking(fd)) return false;
+#endif
+   if (len == 0) {
+      close(fd); return true;
+   }
+   output_queue_member* member = slab_alloc(&member_cache);
+   if (!member) return false;
+   *member = (output_queue_member) {
+      .len = len, .pos = 0,
+      .fd = fd, .offset = offset, .pipe = pipe,
+   };
+   enqueue_member(link, member);
+   return true;
+}
+
+output_buffer* create_output_buffer(char* buf, size_t len) {
+   output_buffer* buffer = malloc(sizeof(output_buffer));
+   if (!buffer) return 0;
+   buffer->buf = buf; buffer->len = len;
+   atomic_init(&buffer->refcount, 1);
+   return buffer;
+}
+
+void release_output_buffer(output_buffer* buffer) {
+   if (atomic_fetch_sub(&buffer->refcount, 1) == 1) {
+      free(buffer->buf); free(buffer);
+   }
+}
+
+bool write_shared_to_link(connection* link, output_buffer* buffer) {
+   if (buffer->len == 0) return true;
+   atomic_fetch_add(&buffer->refcount, 1);
+   if (!enqueue(link, buffer->buf, buffer->len, buffer)) {
+      release_output_buffer(buffer); return false;
+   }
+   return true;
+}
+
+bool mpx_set_zerocopy(struct multiplexor* mpx, size_t threshold) {
+#ifdef HAVE_ZEROCOPY
+   mpx->zerocopy_threshold = threshold;
+   return true;
+#else
+   return threshold == 0;
+#endif
+}
+
+void mpx_set_shedding(struct multiplexor* mpx, unsigned int max_lag,
+      mpx_shedding policy) {
+   mpx->max_lag = max_lag; mpx->shedding_policy = policy;
+   /* the listening socket is to be monitored again
+      if shedding is disabled or no longer paused */
+   if (mpx->running) shed_load(mpx);
+}
+
+void mpx_get_load(struct multiplexor* mpx, mpx_load* load) {
+   *load = mpx->load;
+}
+
+void mpx_enable_stats(struct multiplexor* mpx, bool enable) {
+   mpx->stats_enabled = enable;
+}
+
+void mpx_get_stats(struct multiplexor* mpx, mpx_stats* stats) {
+   *stats = mpx->stats;
+   /* not maintained incrementally as nobody might ask for it */
+   stats->queued = 0;
+   for (size_t slot = 0; slot < mpx->nchunks * SLOT_CHUNK; ++slot) {
+      connection* link = slot_link(mpx, slot);
+      if (link->used) stats->queued += link->oqbytes;
+   }
+}
+
+uint64_t mpx_histogram_percentile(const mpx_histogram* histogram,
+      double percentile) {
+   if (histogram->count == 0) return 0;
+   uint64_t rank = percentile / 100 * histogram->count;
+   if (rank >= histogram->count) rank = histogram->count - 1;
+   uint64_t seen = 0;
+   for (size_t bucket = 0; bucket < MPX_HISTOGRAM_BUCKETS; ++bucket) {
+      seen += histogram->buckets[bucket];
+      if (seen > rank) {
+	 uint64_t limit = bucket_limit(bucket);
+	 return limit < histogram->max? limit: histogram->max;
+      }
+   }
+   return histogram->max;
+}
+
+void mpx_set_watermarks(struct multiplexor* mpx, size_t high, size_t low) {
+   if (low > high) low = high;
+   mpx->high_watermark = high; mpx->low_watermark = low;
+}
+
+void mpx_set_read_budget(struct multiplexor* mpx,
+      size_t bytes, unsigned int calls) {
+   mpx->read_budget = bytes; mpx->read_calls = calls;
+}
+
+void set_link_read_budget(connection* link, size_t bytes, unsigned int calls) {
+   link->read_budget = bytes; link->read_calls = calls;
+}
+
+void set_link_watermarks(connection* link, size_t high, size_t low) {
+   if (low > high) low = high;
+   link->high_watermark = high; link->low_watermark = low;
+   if (high == 0) link->throttled = false;
+   update_events(link->mpx, link);
+}
+
+size_t get_link_queue_size(connection* link) {
+   return link->oqbytes;
+}
+
+void mpx_set_timeouts(struct multiplexor* mpx, unsigned int idle,
+      unsigned int read, unsigned int write) {
+   mpx->idle_timeout = idle;
+   mpx->read_timeout = read;
+   mpx->write_timeout = write;
+}
+
+void set_link_timeouts(connection* link, unsigned int idle,
+      unsigned int read, unsigned int write) {
+   link->idle_timeout = idle;
+   link->read_timeout = read;
+   link->write_timeout = write;
+   schedule_link_timer(link->mpx, link);
+}
+
+bool mpx_post(struct multiplexor* mpx, mpx_post_handler handler, void* arg) {
+   posted_handler* posted = malloc(sizeof(posted_handler));
+   if (!posted) return false;
+   *posted = (posted_handler) {.handler = handler, .arg = arg};
+   pthread_mutex_lock(&mpx->post_mutex);
+   if (mpx->post_tail) {
+      mpx->post_tail->next = posted;
+   } else {
+      mpx->post_head = posted;
+   }
+   mpx->post_tail = posted;
+   /* wake up the event loop unless this has been done already */
+   bool wakeup = !mpx->post_notified;
+   mpx->post_notified = true;
+   pthread_mutex_unlock(&mpx->post_mutex);
+   if (wakeup) notify(mpx);
+   return true;
+}
+
+mpx_watch* mpx_watch_fd(struct multiplexor* mpx, int fd, short events,
+      mpx_watch_handler handler, void* arg) {
+   mpx_watch* watch = malloc(sizeof(mpx_watch));
+   if (!watch) return 0;
+   connection* slot = allocate_slot(mpx);
+   if (!slot) {
+      free(watch); return 0;
+   }
+   *watch = (mpx_watch) {.handler = handler, .arg = arg, .slot = slot};
+   *slot = (connection) {
+      .fd = fd,
+      .events = events,
+      .id = slot->id,
+      .index = slot->index,
+      .mpx = mpx,
+      .watch = watch,
+   };
+   /* otherwise it is registered by mpx_run */
+   if (mpx->running && !engine_add(mpx, fd, events, slot->id)) {
+      slot->watch = 0; release_slot(mpx, slot);
+      free(watch); return 0;
+   }
+   return watch;
+}
+
+void mpx_unwatch_fd(struct multiplexor* mpx, mpx_watch* watch) {
+   connection* slot = watch->slot;
+   if (slot->removed) return;
+   /* the fd may be closed right after we return,
+      hence it has to be deregistered immediately;
+      the slot is kept until the end of the iteration
+      such that pending events of the watch are dropped */
+   if (mpx->running) engine_remove(mpx, slot);
+   schedule_removal(mpx, slot);
+}
+
+char* mpx_borrow_buffer(struct multiplexor* mpx, size_t* size) {
+   *size = mpx->buffer_size;
+   pooled_buffer* buffer = mpx->buffers;
+   if (buffer) {
+      mpx->buffers = buffer->next; --mpx->nbuffers;
+      return (char*) buffer;
+   }
+   return malloc(mpx->buffer_size);
+}
+
+void mpx_return_buffer(struct multiplexor* mpx, char* buf, size_t size) {
+   if (!buf) return;
+   /* buffers which have been resized are not kept */
+   if (size != mpx->buffer_size || mpx->nbuffers >= mpx->max_buffers) {
+      free(buf); return;
+   }
+   pooled_buffer* buffer = (pooled_buffer*) buf;
+   buffer->next = mpx->buffers;
+   mpx->buffers = buffer; ++mpx->nbuffers;
+}
+
+void mpx_set_buffer_pool(struct multiplexor* mpx, size_t size, size_t max) {
+   if (size < sizeof(pooled_buffer)) size = sizeof(pooled_buffer);
+   /* release unused buffers which no longer fit */
+   while (mpx->buffers &&
+	 (size != mpx->buffer_size || mpx->nbuffers > max)) {
+      pooled_buffer* buffer = mpx->buffers;
+      mpx->buffers = buffer->next; --mpx->nbuffers;
+      free(buffer);
+   }
+   mpx->buffer_size = size; mpx->max_buffers = max;
+}
+
+mpx_timer* mpx_add_timer(struct multiplexor* mpx, unsigned int ms,
+      mpx_timer_handler handler, void* arg) {
+   mpx_timer* timer = malloc(sizeof(mpx_timer));
+   if (!timer) return 0;
+   *timer = (mpx_timer) {
+      .deadline = mpx->now + ms,
+      .handler = handler,
+      .arg = arg,
+      .allocated = true,
+   };
+   wheel_insert(&mpx->timers, timer);
+   return timer;
+}
+
+void mpx_cancel_timer(struct multiplexor* mpx, mpx_timer* timer) {
+   wheel_remove(&mpx->timers, timer);
+   free(timer);
+}
+
+mpx_link_id get_link_id(connection* link) {
+   return link->id;
+}
+
+int get_link_listener(connection* link) {
+   return link->listener;
+}
+
+connection* mpx_get_link(struct multiplexor* mpx, mpx_link_id id) {
+   connection* link = find_slot(mpx, id);
+   if (!link || !link->used) return 0;
+   return link;
+}
+
+connection* mpx_connect(struct multiplexor* mpx, const hostport* hp,
+      multiplexor_handler open_handler,
+      multiplexor_handler input_handler,
+      multiplexor_handler close_handler,
+      void* handle) {
+   int fd = socket(hp->domain, hp->type? hp->type: SOCK_STREAM,
+      hp->protocol);
+   if (fd < 0) return 0;
+   if (!set_nonblocking(fd) || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ||
+	 (connect(fd, (const struct sockaddr*) &hp->addr, hp->namelen) < 0 &&
+	    errno != EINPROGRESS)) {
+      int error = errno; close(fd); errno = error;
+      return 0;
+   }
+   connection* link = allocate_slot(mpx);
+   if (!link) {
+      close(fd); errno = ENOMEM; return 0;
+   }
+   /* even if connect() succeeded immediately, open_handler is
+      not invoked before the socket is reported to be writable */
+   init_link(mpx, link, fd, POLLOUT);
+   link->connecting = true;
+   link->handle = handle;
+   link->ohandler = open_handler;
+   link->ihandler = input_handler;
+   link->chandler = close_handler;
+   /* otherwise it is registered by mpx_run */
+   if (mpx->running && !engine_add(mpx, fd, POLLOUT, link->id)) {
+      int error = errno; close(fd); release_slot(mpx, link); errno = error;
+      return 0;
+   }
+   ++mpx->count;
+   schedule_link_timer(mpx, link);
+   return link;
+}
+
+bool splice_links(connection* link1, connection* link2) {
+#ifdef HAVE_SPLICE
+   if (link1 == link2 || link1->mpx != link2->mpx ||
+	 link1->peer || link2->peer || link1->watch || link2->watch) {
+      errno = EINVAL; return false;
+   }
+   int fds1[2]; int fds2[2];
+   if (pipe2(fds1, O_NONBLOCK | O_CLOEXEC) < 0) return false;
+   if (pipe2(fds2, O_NONBLOCK | O_CLOEXEC) < 0) {
+      int error = errno; close(fds1[0]); close(fds1[1]); errno = error;
+      return false;
+   }
+   link1->pipefds[0] = fds1[0]; link1->pipefds[1] = fds1[1];
+   link2->pipefds[0] = fds2[0]; link2->pipefds[1] = fds2[1];
+   link1->peer = link2; link2->peer = link1;
+   update_events(link1->mpx, link1); update_events(link2->mpx, link2);
+   return true;
+#else
+   errno = ENOSYS; return false;
+#endif
+}
+
+connection* proxy_link(connection* link, const hostport* hp) {
+   connection* outbound = mpx_connect(link->mpx, hp, 0, 0, 0, 0);
+   if (!outbound) return 0;
+   if (!splice_links(link, outbound)) {
+      /* just to be removed at the end of the iteration */
+      int error = errno; close_link(outbound); errno = error;
+      return 0;
+   }
+   return outbound;
+}
+
+void close_link(connection* link) {
+   if (link->peer) {
+      /* both spliced links are closed */
+      discard_output(link);
+      link->eof = true; schedule_removal(link->mpx, link);
+      return;
+   }
    link->eof = true;
    shutdown(link->fd, SHUT_RD);
+   update_events(link->mpx, link);
 }
@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2003, 2008, 2013, 2019 Andreas Franz Borchert
+   Copyright (C) 2003, 2008, 2013, 2019, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -21,31 +21,212 @@
 #define AFBLIB_MULTIPLEXOR_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
 
+struct multiplexor;
+struct hostport;
+typedef void (*mpx_timer_handler)(struct multiplexor* mpx, void* arg);
+typedef void (*mpx_post_handler)(struct multiplexor* mpx, void* arg);
+typedef void (*mpx_watch_handler)(struct multiplexor* mpx,
+   int fd, short revents, void* arg);
+typedef struct mpx_watch mpx_watch;
+
+typedef struct mpx_timer {
+   /* private fields */
+   uint64_t deadline; /* in milliseconds of CLOCK_MONOTONIC */
+   mpx_timer_handler handler;
+   void* arg;
+   bool active; /* inserted into the timer wheel */
+   bool allocated; /* allocated by mpx_add_timer */
+   unsigned char level, slot; /* position within the timer wheel */
+   struct mpx_timer* next;
+   struct mpx_timer* prev;
+} mpx_timer;
+
 typedef struct connection {
    int fd;
    void* handle; /* may be freely used by the application */
    void* mpx_handle; /* corresponding parameter from run_multiplexor */
+   struct multiplexor* mpx; /* multiplexor managing this connection */
    /* private fields */
-   struct multiplexor* mpx; /* internal link to global structure */
+   void (*ohandler)(struct connection* link); /* outbound links only */
+   void (*ihandler)(struct connection* link);
+   void (*chandler)(struct connection* link);
    bool eof;
+   bool removed; /* scheduled for removal at the end of the iteration */
+   bool throttled; /* output queue exceeded the high watermark */
+   bool used; /* slot is occupied by a connection */
+   bool armed; /* io_uring engine: poll request is pending */
+   bool blocked; /* io_uring engine: send request ran into EAGAIN */
+   bool discarded; /* io_uring engine: output is discarded once ... */
+   struct send_request* send; /* ... the pending send request completed */
+   bool zerocopy; /* SO_ZEROCOPY is enabled for fd */
+   bool connecting; /* outbound connection is not established yet */
+   bool shut_peer; /* end of input has been passed on to peer */
+   bool drained; /* read_from_link ran into EAGAIN */
+   bool ready; /* queued to be read again without waiting for events */
+   short events; /* events currently monitored by the event engine */
+   int listener; /* index of the accepting socket, -1 for outbound links */
+   uint64_t id; /* generation-tagged slot index, see get_link_id */
+   size_t index; /* slot index, shared with the pollfd array */
    struct output_queue_member* oqhead;
    struct output_queue_member* oqtail;
-   struct connection* next;
-   struct connection* prev;
+   size_t oqbytes; /* number of bytes queued but not yet sent */
+   struct output_queue_member* zchead; /* sent with MSG_ZEROCOPY but */
+   struct output_queue_member* zctail; /* ... still used by the kernel */
+   uint32_t zcnext; /* id of the next MSG_ZEROCOPY send */
+   uint64_t zclinger; /* time when retained packets are given up, */
+   uint64_t zcretry; /* ... the error queue is checked again */
+   unsigned int zcdelay; /* in ms, grows while notifications are missing */
+   size_t high_watermark, low_watermark;
+   size_t read_budget; /* max bytes read per iteration, 0 if unlimited */
+   unsigned int read_calls; /* max reads per iteration, 0 if unlimited */
+   size_t bytes_read; /* bytes read in the current iteration */
+   unsigned int reads; /* reads in the current iteration */
+   uint64_t pipe_retry; /* time when an empty pipe is tried again */
+   unsigned int pipe_delay; /* in ms, grows while the pipe remains empty */
+   uint64_t uring_retry; /* io_uring engine: time when link is armed again */
+   unsigned int uring_delay; /* in ms, grows while nothing else happens */
+   unsigned int idle_timeout, read_timeout, write_timeout; /* in ms */
+   uint64_t last_activity, last_read, last_write; /* in ms */
+   mpx_timer timer; /* pending if any of the timeouts applies */
+   mpx_watch* watch; /* non-null if the slot is taken by mpx_watch_fd */
+   struct connection* peer; /* non-null if spliced, see splice_links */
+   int pipefds[2]; /* input of this link on its way to peer */
+   size_t piped; /* number of bytes in pipefds */
+   struct connection* next; /* list of removed or free slots */
 } connection;
 
+typedef uint64_t mpx_link_id;
+
 typedef void (*multiplexor_handler)(connection* link);
 
+typedef enum {
+   MPX_SHED_NONE, /* keep accepting regardless of the loop lag */
+   MPX_SHED_PAUSE, /* stop accepting while overloaded */
+   MPX_SHED_REJECT, /* close new connections while overloaded */
+} mpx_shedding;
+
+/* load statistics of a multiplexor, times in microseconds */
+typedef struct mpx_load {
+   uint64_t iterations; /* of the event loop */
+   uint64_t busy_time; /* spent in handlers and housekeeping */
+   uint64_t wait_time; /* spent waiting for events */
+   uint64_t lag; /* smoothed busy time per iteration */
+   uint64_t rejected; /* connections closed by MPX_SHED_REJECT */
+   bool shedding; /* lag exceeded the threshold of mpx_set_shedding */
+} mpx_load;
+
+/* latency histogram with four buckets per power of two */
+#define MPX_HISTOGRAM_BUCKETS 256
+typedef struct mpx_histogram {
+   uint64_t count;
+   uint64_t sum; /* in nanoseconds */
+   uint64_t max; /* in nanoseconds */
+   uint64_t buckets[MPX_HISTOGRAM_BUCKETS];
+} mpx_histogram;
+
+/* counters and handler latencies of a multiplexor */
+typedef struct mpx_stats {
+   uint64_t accepts; /* connections added to the multiplexor */
+   uint64_t rejected; /* connections closed right after accept() */
+   uint64_t accept_failures; /* failed accepts and additions */
+   uint64_t reads, writes; /* successful system calls */
+   uint64_t bytes_in, bytes_out;
+   uint64_t queued; /* bytes currently queued for output */
+   uint64_t wakeups; /* returns from the event engine */
+   mpx_histogram open_latency, input_latency, close_latency;
+} mpx_stats;
+
+typedef enum {
+   MPX_ENGINE_DEFAULT, /* epoll, if available, poll otherwise */
+   MPX_ENGINE_POLL,
+   MPX_ENGINE_EPOLL, /* Linux only */
+   MPX_ENGINE_IO_URING, /* Linux only, falls back to the default */
+} mpx_engine;
+
 void run_multiplexor(int socket,
    multiplexor_handler open_handler,
    multiplexor_handler input_handler,
    multiplexor_handler close_handler,
    void* mpx_handle);
+
+void run_multiplexor_mt(int socket, unsigned int nthreads,
+   multiplexor_handler open_handler,
+   multiplexor_handler input_handler,
+   multiplexor_handler close_handler,
+   void* mpx_handle);
+
+struct multiplexor* mpx_setup(int socket,
+   multiplexor_handler open_handler,
+   multiplexor_handler input_handler,
+   multiplexor_handler close_handler,
+   void* mpx_handle);
+struct multiplexor* mpx_setup_sockets(const int* sockets, size_t nsockets,
+   multiplexor_handler open_handler,
+   multiplexor_handler input_handler,
+   multiplexor_handler close_handler,
+   void* mpx_handle);
+bool mpx_set_engine(struct multiplexor* mpx, mpx_engine engine);
+void mpx_set_watermarks(struct multiplexor* mpx, size_t high, size_t low);
+bool mpx_set_zerocopy(struct multiplexor* mpx, size_t threshold);
+void mpx_set_shedding(struct multiplexor* mpx, unsigned int max_lag,
+   mpx_shedding policy);
+void mpx_get_load(struct multiplexor* mpx, mpx_load* load);
+void mpx_enable_stats(struct multiplexor* mpx, bool enable);
+void mpx_get_stats(struct multiplexor* mpx, mpx_stats* stats);
+uint64_t mpx_histogram_percentile(const mpx_histogram* histogram,
+   double percentile);
+void mpx_set_read_budget(struct multiplexor* mpx,
+   size_t bytes, unsigned int calls);
+void mpx_set_timeouts(struct multiplexor* mpx, unsigned int idle,
+   unsigned int read, unsigned int write);
+mpx_engine mpx_get_engine(struct multiplexor* mpx);
+void mpx_run(struct multiplexor* mpx);
+void mpx_free(struct multiplexor* mpx);
+
 bool write_to_link(connection* link, char* buf, size_t len);
+bool copy_to_link(connection* link, const char* buf, size_t len);
+bool write_file_to_link(connection* link, int fd, off_t offset, size_t len);
 ssize_t read_from_link(connection* link, char* buf, size_t len);
+connection* mpx_connect(struct multiplexor* mpx, const struct hostport* hp,
+   multiplexor_handler open_handler,
+   multiplexor_handler input_handler,
+   multiplexor_handler close_handler,
+   void* handle);
+bool splice_links(connection* link1, connection* link2);
+connection* proxy_link(connection* link, const struct hostport* hp);
 void close_link(connection* link);
+mpx_link_id get_link_id(connection* link);
+int get_link_listener(connection* link);
+connection* mpx_get_link(struct multiplexor* mpx, mpx_link_id id);
+void set_link_watermarks(connection* link, size_t high, size_t low);
+void set_link_read_budget(connection* link, size_t bytes, unsigned int calls);
+size_t get_link_queue_size(connection* link);
+void set_link_timeouts(connection* link, unsigned int idle,
+   unsigned int read, unsigned int write);
+
+mpx_timer* mpx_add_timer(struct multiplexor* mpx, unsigned int ms,
+   mpx_timer_handler handler, void* arg);
+void mpx_cancel_timer(struct multiplexor* mpx, mpx_timer* timer);
+
+bool mpx_post(struct multiplexor* mpx, mpx_post_handler handler, void* arg);
+
+mpx_watch* mpx_watch_fd(struct multiplexor* mpx, int fd, short events,
+   mpx_watch_handler handler, void* arg);
+void mpx_unwatch_fd(struct multiplexor* mpx, mpx_watch* watch);
+
+/* pool of read buffers which are borrowed while input is pending */
+char* mpx_borrow_buffer(struct multiplexor* mpx, size_t* size);
+void mpx_return_buffer(struct multiplexor* mpx, char* buf, size_t size);
+void mpx_set_buffer_pool(struct multiplexor* mpx, size_t size, size_t max);
+
+/* reference-counted output buffer that can be queued on many links */
+typedef struct output_buffer output_buffer;
+output_buffer* create_output_buffer(char* buf, size_t len);
+bool write_shared_to_link(connection* link, output_buffer* buffer);
+void release_output_buffer(output_buffer* buffer);
 
 #endif
@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2013, 2014, 2021 Andreas Franz Borchert
+   Copyright (C) 2013, 2014, 2021, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -30,6 +30,9 @@ run_preforked_service -- run a TCP-based service on a given hostport
 
    void run_preforked_service(hostport* hp, session_handler handler,
       unsigned int number_of_processes, void* service_handle);
+   void run_preforked_service_with_profile(hostport* hp,
+      const socket_profile* profile, session_handler handler,
+      unsigned int number_of_processes, void* service_handle);
 
 =head1 DESCRIPTION
 
@@ -42,6 +45,10 @@ This means that there will be always I<number_of_processes> processes
 ready to accept a connection. The I<service_handle> parameter is
 forwarded to I<handler> when called.
 
+I<run_preforked_service_with_profile> works like
+I<run_preforked_service> but configures the listening socket
+according to I<profile> (see L<listener>).
+
 If the main process gets a SIGTERM signal, this will be distributed
 to all children, causing all processes to terminate. Running sessions,
 however, will not be interrupted.
@@ -104,20 +111,16 @@ static pid_t spawn_preforked_process(int sfd, int pipefds[2],
     incoming connection in a separate process */
 void run_preforked_service(hostport* hp, session_handler handler,
       unsigned int number_of_processes, void* service_handle) {
+   run_preforked_service_with_profile(hp, 0, handler,
+      number_of_processes, service_handle);
+}
+
+void run_preforked_service_with_profile(hostport* hp,
+      const socket_profile* profile, session_handler handler,
+      unsigned int number_of_processes, void* service_handle) {
    assert(number_of_processes > 0);
-   if (!hp->type) {
-      hp->type = SOCK_STREAM;
-   }
-   int sfd = socket(hp->domain, hp->type, hp->protocol);
-   int optval = 1;
-   if (sfd < 0 ||
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR,
-                   &optval, sizeof optval) < 0 ||
-        bind(sfd, (struct sockaddr *) &hp->addr, hp->namelen) < 0 ||
-        listen(sfd, SOMAXCONN) < 0) {
-      close(sfd);
-      return;
-   }
+   int sfd = create_listener(hp, profile);
+   if (sfd < 0) return;
 
    /* setup termination handler */
    struct sigaction action = {
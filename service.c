@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2003, 2008, 2013, 2021 Andreas Franz Borchert
+   Copyright (C) 2003, 2008, 2013, 2021, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -30,6 +30,9 @@ run_service -- run a TCP-based service on a given hostport
 
    void run_service(hostport* hp, session_handler handler,
       void* service_handle);
+   void run_service_with_profile(hostport* hp,
+      const socket_profile* profile,
+      session_handler handler, void* service_handle);
 
 =head1 DESCRIPTION
 
@@ -40,6 +43,9 @@ with the provided handle I<service_handle>.  As soon the session
 handler returns, the spawned off process terminates with an exit code
 of 0.
 
+I<run_service_with_profile> works like I<run_service> but configures
+the listening socket according to I<profile> (see L<listener>).
+
 I<run_service> terminates only in case of errors. I<SA_NOCLDWAIT>
 is set for I<SIGCHLD> such that all forked-off processes do not
 become zombies.
@@ -62,19 +68,14 @@ Andreas F. Borchert
    incoming connection */
 void run_service(hostport* hp, session_handler handler,
       void* service_handle) {
-   if (!hp->type) {
-      hp->type = SOCK_STREAM;
-   }
-   int sfd = socket(hp->domain, hp->type, hp->protocol);
-   int optval = 1;
-   if (sfd < 0 ||
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR,
-                   &optval, sizeof optval) < 0 ||
-        bind(sfd, (struct sockaddr *) &hp->addr, hp->namelen) < 0 ||
-        listen(sfd, SOMAXCONN) < 0) {
-      close(sfd);
-      return;
-   }
+   run_service_with_profile(hp, 0, handler, service_handle);
+}
+
+void run_service_with_profile(hostport* hp,
+      const socket_profile* profile,
+      session_handler handler, void* service_handle) {
+   int sfd = create_listener(hp, profile);
+   if (sfd < 0) return;
 
    /* our children shall not become zombies */
    struct sigaction action = {
@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2003, 2008, 2013, 2021 Andreas Franz Borchert
+   Copyright (C) 2003, 2008, 2013, 2021, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -20,6 +20,7 @@
 #define AFBLIB_SERVICE_H
 
 #include <afblib/hostport.h>
+#include <afblib/listener.h>
 
 typedef void (*session_handler)(int fd, void* service_handle);
 
@@ -27,5 +28,8 @@ typedef void (*session_handler)(int fd, void* service_handle);
    incoming connection */
 void run_service(hostport* hp, session_handler handler,
    void* service_handle);
+void run_service_with_profile(hostport* hp,
+   const socket_profile* profile,
+   session_handler handler, void* service_handle);
 
 #endif
@@ -0,0 +1,343 @@
+/*
+   Small library of useful utilities
+   Copyright (C) 2026 Andreas Franz Borchert
+   --------------------------------------------------------------------
+   This library is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+
+=head1 NAME
+
+slab -- allocator for objects of fixed size
+
+=head1 SYNOPSIS
+
+   #include <afblib/slab.h>
+
+   typedef struct slab_cache {
+      const char* name;
+      size_t size;
+      // private fields
+   } slab_cache;
+
+   #define SLAB_CACHE_INITIALIZER(cachename, type) // ...
+
+   typedef struct slab_stats {
+      const char* name;
+      size_t size;
+      uint64_t allocs, frees;
+      uint64_t in_use;
+      size_t slabs;
+      size_t bytes;
+   } slab_stats;
+
+   void* slab_alloc(slab_cache* cache);
+   void slab_free(slab_cache* cache, void* object);
+
+   void slab_get_stats(slab_cache* cache, slab_stats* stats);
+   size_t slab_get_all_stats(slab_stats* stats, size_t len);
+   void slab_use_hugepages(bool enable);
+
+=head1 DESCRIPTION
+
+A slab cache provides objects of one fixed size which are
+allocated and released frequently, like the nodes of lists or hash
+tables. Caches are typically declared statically and initialized by
+I<SLAB_CACHE_INITIALIZER> which takes a name for the statistics and
+the type of the objects:
+
+   static slab_cache entry_cache =
+      SLAB_CACHE_INITIALIZER("strhash_entry", strhash_entry);
+
+I<slab_alloc> returns an uninitialized object of I<cache>, or null
+if it runs out of memory. I<slab_free> returns I<object> which must
+have been allocated from the same I<cache>. Null pointers are
+accepted and ignored by I<slab_free>.
+
+Each thread has a magazine of up to 32 objects per cache from which
+objects are allocated and to which they are released without any
+locking. An empty magazine is refilled up to half of its capacity
+from the depot of the cache, and a full magazine gives half of its
+objects back to the depot. Objects which are freed by another thread
+than the one which allocated them end up in the magazine of the
+releasing thread. The magazine of a terminating thread is returned
+to the depot. Objects of the depot come from slabs of one page (or
+more pages if less than eight objects would fit into one page) which
+are carved from extents of 2 MiB that are obtained by I<mmap>.
+Memory of slabs is kept by the depot and never returned to the
+system. Objects are aligned like I<malloc> does.
+
+I<slab_use_hugepages> asks for extents backed by huge pages. Under
+Linux, I<MAP_HUGETLB> is tried first, and otherwise transparent huge
+pages are requested by I<madvise> for extents which are aligned
+accordingly. This applies to extents which are obtained subsequently.
+
+I<slab_get_stats> fills I<*stats> with the counters of I<cache>: the
+number of allocations and releases, the number of objects which are
+currently in use, the number of slabs, and the memory taken by them.
+I<slab_get_all_stats> does this for up to I<len> caches which have
+been used so far and returns the total number of these caches.
+
+=head1 AUTHOR
+
+Andreas F. Borchert
+
+=cut
+
+*/
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <afblib/slab.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define MAGAZINE_SIZE 32 /* objects kept per thread and cache */
+#define SLAB_OBJECTS 8 /* minimal number of objects per slab */
+#define EXTENT_SIZE ((size_t) 2 << 20) /* obtained at once from the system */
+#define OBJECT_ALIGN _Alignof(max_align_t)
+
+typedef struct magazine {
+   slab_cache* cache;
+   size_t count;
+   void* objects[MAGAZINE_SIZE];
+} magazine;
+
+/* free objects of the depot are chained through their first word */
+typedef struct free_object {
+   struct free_object* next;
+} free_object;
+
+/* protects all following variables */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static slab_cache* caches; /* linear list of initialized caches */
+static char* extent_next; /* unused remainder of the current extent */
+static char* extent_end;
+static bool hugepages;
+
+static void* map_extent(size_t size, bool huge) {
+   int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+   if (huge) {
+      void* extent = mmap(0, size, PROT_READ | PROT_WRITE,
+	 flags | MAP_HUGETLB, -1, 0);
+      if (extent != MAP_FAILED) return extent;
+   }
+#endif
+#ifdef MADV_HUGEPAGE
+   if (huge) {
+      /* transparent huge pages need aligned extents, hence we map
+	 more than needed and give up the unaligned parts */
+      char* area = mmap(0, size + EXTENT_SIZE, PROT_READ | PROT_WRITE,
+	 flags, -1, 0);
+      if (area != MAP_FAILED) {
+	 char* extent = (char*) (((uintptr_t) area + EXTENT_SIZE - 1) &
+	    ~(uintptr_t) (EXTENT_SIZE - 1));
+	 if (extent > area) munmap(area, extent - area);
+	 char* end = area + size + EXTENT_SIZE;
+	 if (end > extent + size) munmap(extent + size, end - (extent + size));
+	 madvise(extent, size, MADV_HUGEPAGE);
+	 return extent;
+      }
+      /* fall back to an unaligned extent without huge pages */
+   }
+#endif
+   void* extent = mmap(0, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+   if (extent == MAP_FAILED) return 0;
+   return extent;
+}
+
+/* take a new slab of the given size from the current extent */
+static char* allocate_slab(size_t size) {
+   pthread_mutex_lock(&registry_mutex);
+   if ((size_t) (extent_end - extent_next) < size) {
+      size_t extent_size = (size + EXTENT_SIZE - 1) / EXTENT_SIZE *
+	 EXTENT_SIZE;
+      char* extent = map_extent(extent_size, hugepages);
+      if (!extent) {
+	 pthread_mutex_unlock(&registry_mutex); return 0;
+      }
+      extent_next = extent; extent_end = extent + extent_size;
+   }
+   char* slab = extent_next;
+   extent_next += size;
+   pthread_mutex_unlock(&registry_mutex);
+   return slab;
+}
+
+static void release_magazine(void* arg);
+
+/* set up cache on its first use */
+static bool init_cache(slab_cache* cache) {
+   if (atomic_load_explicit(&cache->initialized, memory_order_acquire)) {
+      return true;
+   }
+   pthread_mutex_lock(&cache->mutex);
+   bool ok = atomic_load_explicit(&cache->initialized, memory_order_relaxed);
+   if (!ok && pthread_key_create(&cache->key, release_magazine) == 0) {
+      size_t stride = cache->size;
+      if (stride < sizeof(free_object)) stride = sizeof(free_object);
+      stride = (stride + OBJECT_ALIGN - 1) / OBJECT_ALIGN * OBJECT_ALIGN;
+      long page_size = sysconf(_SC_PAGESIZE);
+      if (page_size <= 0) page_size = 4096;
+      cache->stride = stride;
+      cache->slab_size = (SLAB_OBJECTS * stride + page_size - 1) /
+	 page_size * page_size;
+      pthread_mutex_lock(&registry_mutex);
+      cache->next = caches; caches = cache;
+      pthread_mutex_unlock(&registry_mutex);
+      atomic_store_explicit(&cache->initialized, true, memory_order_release);
+      ok = true;
+   }
+   pthread_mutex_unlock(&cache->mutex);
+   return ok;
+}
+
+/* take an object from the depot of cache which must be locked;
+   a new slab is allocated only if grow is true */
+static void* take_object(slab_cache* cache, bool grow) {
+   free_object* object = cache->depot;
+   if (object) {
+      cache->depot = object->next; return object;
+   }
+   if ((size_t) (cache->end - cache->unused) < cache->stride) {
+      if (!grow) return 0;
+      char* slab = allocate_slab(cache->slab_size);
+      if (!slab) return 0;
+      cache->unused = slab; cache->end = slab + cache->slab_size;
+      ++cache->slabs;
+   }
+   void* result = cache->unused;
+   cache->unused += cache->stride;
+   return result;
+}
+
+/* put an object into the depot of cache which must be locked */
+static void put_object(slab_cache* cache, void* object) {
+   free_object* fo = object;
+   fo->next = cache->depot; cache->depot = fo;
+}
+
+/* return the magazine of the current thread, if possible */
+static magazine* get_magazine(slab_cache* cache) {
+   magazine* mag = pthread_getspecific(cache->key);
+   if (!mag) {
+      mag = malloc(sizeof(magazine));
+      if (!mag) return 0;
+      *mag = (magazine) {.cache = cache};
+      if (pthread_setspecific(cache->key, mag)) {
+	 free(mag); return 0;
+      }
+   }
+   return mag;
+}
+
+/* return the magazine of a terminating thread to the depot */
+static void release_magazine(void* arg) {
+   magazine* mag = arg;
+   slab_cache* cache = mag->cache;
+   pthread_mutex_lock(&cache->mutex);
+   while (mag->count > 0) {
+      put_object(cache, mag->objects[--mag->count]);
+   }
+   pthread_mutex_unlock(&cache->mutex);
+   free(mag);
+}
+
+void* slab_alloc(slab_cache* cache) {
+   if (!init_cache(cache)) return 0;
+   magazine* mag = get_magazine(cache);
+   void* object;
+   if (mag && mag->count > 0) {
+      object = mag->objects[--mag->count];
+   } else {
+      /* refill the magazine from the depot up to half of its capacity
+	 but do not allocate new slabs just for the magazine */
+      pthread_mutex_lock(&cache->mutex);
+      object = take_object(cache, true);
+      while (object && mag && mag->count < MAGAZINE_SIZE / 2) {
+	 void* extra = take_object(cache, false);
+	 if (!extra) break;
+	 mag->objects[mag->count++] = extra;
+      }
+      pthread_mutex_unlock(&cache->mutex);
+      if (!object) return 0;
+   }
+   atomic_fetch_add_explicit(&cache->allocs, 1, memory_order_relaxed);
+   return object;
+}
+
+void slab_free(slab_cache* cache, void* object) {
+   if (!object) return;
+   atomic_fetch_add_explicit(&cache->frees, 1, memory_order_relaxed);
+   magazine* mag = get_magazine(cache);
+   if (mag && mag->count < MAGAZINE_SIZE) {
+      mag->objects[mag->count++] = object; return;
+   }
+   /* give half of a full magazine back to the depot */
+   pthread_mutex_lock(&cache->mutex);
+   put_object(cache, object);
+   while (mag && mag->count > MAGAZINE_SIZE / 2) {
+      put_object(cache, mag->objects[--mag->count]);
+   }
+   pthread_mutex_unlock(&cache->mutex);
+}
+
+void slab_get_stats(slab_cache* cache, slab_stats* stats) {
+   /* frees are loaded first such that in_use does not underflow
+      for objects which are allocated and freed in the meantime */
+   uint64_t frees = atomic_load_explicit(&cache->frees, memory_order_relaxed);
+   uint64_t allocs = atomic_load_explicit(&cache->allocs,
+      memory_order_relaxed);
+   pthread_mutex_lock(&cache->mutex);
+   size_t slabs = cache->slabs;
+   size_t bytes = slabs * cache->slab_size;
+   pthread_mutex_unlock(&cache->mutex);
+   *stats = (slab_stats) {
+      .name = cache->name,
+      .size = cache->size,
+      .allocs = allocs,
+      .frees = frees,
+      .in_use = allocs > frees? allocs - frees: 0,
+      .slabs = slabs,
+      .bytes = bytes,
+   };
+}
+
+size_t slab_get_all_stats(slab_stats* stats, size_t len) {
+   /* caches are never removed from the list and new caches are
+      inserted in front of it, hence the list can be traversed
+      without holding the registry lock which must not be held
+      while a cache is locked */
+   pthread_mutex_lock(&registry_mutex);
+   slab_cache* cache = caches;
+   pthread_mutex_unlock(&registry_mutex);
+   size_t count = 0;
+   for (; cache; cache = cache->next) {
+      if (count < len) slab_get_stats(cache, &stats[count]);
+      ++count;
+   }
+   return count;
+}
+
+void slab_use_hugepages(bool enable) {
+   pthread_mutex_lock(&registry_mutex);
+   hugepages = enable;
+   pthread_mutex_unlock(&registry_mutex);
+}
@@ -0,0 +1,68 @@
+/*
+   Small library of useful utilities
+   Copyright (C) 2026 Andreas Franz Borchert
+   --------------------------------------------------------------------
+   This library is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#ifndef AFBLIB_SLAB_H
+#define AFBLIB_SLAB_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct slab_cache {
+   const char* name;
+   size_t size; /* of the objects */
+   /* private fields */
+   pthread_mutex_t mutex; /* protects the depot */
+   atomic_bool initialized;
+   pthread_key_t key; /* magazine of the current thread */
+   size_t stride; /* size rounded up to the alignment */
+   size_t slab_size;
+   void* depot; /* linear list of free objects */
+   char* unused; /* remainder of the last slab */
+   char* end; /* end of the last slab */
+   size_t slabs; /* number of allocated slabs */
+   atomic_uint_fast64_t allocs, frees;
+   struct slab_cache* next; /* list of all initialized caches */
+} slab_cache;
+
+#define SLAB_CACHE_INITIALIZER(cachename, type) { \
+   .name = (cachename), \
+   .size = sizeof(type), \
+   .mutex = PTHREAD_MUTEX_INITIALIZER, \
+}
+
+typedef struct slab_stats {
+   const char* name;
+   size_t size; /* of the objects */
+   uint64_t allocs, frees;
+   uint64_t in_use; /* objects which are currently allocated */
+   size_t slabs;
+   size_t bytes; /* taken by the slabs */
+} slab_stats;
+
+void* slab_alloc(slab_cache* cache);
+void slab_free(slab_cache* cache, void* object);
+
+void slab_get_stats(slab_cache* cache, slab_stats* stats);
+size_t slab_get_all_stats(slab_stats* stats, size_t len);
+void slab_use_hugepages(bool enable);
+
+#endif
@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2003, 2008 Andreas Franz Borchert
+   Copyright (C) 2003, 2008, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -95,8 +95,12 @@ Andreas F. Borchert
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <afblib/slab.h>
 #include <afblib/strhash.h>
 
+static slab_cache entry_cache =
+   SLAB_CACHE_INITIALIZER("strhash_entry", strhash_entry);
+
 /* hash algorithm stolen from Dan Bernstein's cdbhash.c */
 #define HASHSTART 5381
 
@@ -143,7 +147,7 @@ int strhash_add(strhash* hash, char* key, char* value) {
    strhash_entry** prev;
    /* check uniqueness */
    if (strhash_find(hash, key, &prev)) return 0;
-   strhash_entry* entry = malloc(sizeof(strhash_entry));
+   strhash_entry* entry = slab_alloc(&entry_cache);
    if (entry == 0) return 0;
    entry->key = key;
    entry->value = value;
@@ -159,7 +163,7 @@ int strhash_remove(strhash* hash, char* key) {
    if (!strhash_find(hash, key, &prev)) return 0;
    strhash_entry* entry = *prev;
    *prev = entry->next;
-   free(entry);
+   slab_free(&entry_cache, entry);
    return 1;
 }
 
@@ -217,7 +221,7 @@ int strhash_free(strhash* hash) {
       strhash_entry* entry = hash->bucket[index];
       while (entry != 0) {
          strhash_entry* next = entry->next;
-         free(entry);
+         slab_free(&entry_cache, entry);
          entry = next;
       }
    }
@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2015, 2021 Andreas Franz Borchert
+   Copyright (C) 2015, 2021, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -40,6 +40,13 @@ udp_session -- run an UDP service with sessions
       udp_connection_handler input_handler,
       udp_connection_handler close_handler,
       void* global_handle);
+   void run_udp_service_with_profile(hostport* hp,
+      const socket_profile* profile,
+      int timeout, unsigned int max_retries,
+      udp_connection_handler open_handler,
+      udp_connection_handler input_handler,
+      udp_connection_handler close_handler,
+      void* global_handle);
 
    bool write_to_udp_link(udp_connection* link, void* buf, size_t len);
    ssize_t read_from_udp_link(udp_connection* link, void* buf, size_t len);
@@ -90,6 +97,10 @@ to I<run_udp_service>.
 
 =back
 
+I<run_udp_service_with_profile> works like I<run_udp_service> but
+configures the main socket according to I<profile> (see L<listener>).
+Options which are specific to TCP are ignored.
+
 I<run_udp_service> runs normally infinitely and returns in
 error cases only.
 
@@ -105,6 +116,7 @@ Andreas F. Borchert
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <afblib/slab.h>
 #include <afblib/udp_session.h>
 
 typedef struct output_queue_member {
@@ -115,6 +127,11 @@ typedef struct output_queue_member {
    struct output_queue_member* next; /* next in queue */
 } output_queue_member;
 
+static slab_cache link_cache =
+   SLAB_CACHE_INITIALIZER("udp_connection", udp_connection);
+static slab_cache member_cache =
+   SLAB_CACHE_INITIALIZER("udp_output_queue_member", output_queue_member);
+
 typedef struct udp_multiplexor {
    int socket;
    hostport hp;
@@ -137,7 +154,7 @@ static void discard_oq_head(udp_connection* link) {
    if (link->oqhead) {
       output_queue_member* old = link->oqhead;
       link->oqhead = link->oqhead->next;
-      free(old);
+      slab_free(&member_cache, old);
       if (!link->oqhead) link->oqtail = 0;
    }
 }
@@ -166,7 +183,7 @@ static void remove_link(multiplexor* mpx, udp_connection* link) {
    }
    if (mpx->chandler) (*mpx->chandler)(link);
    discard_oq(link);
-   free(link);
+   slab_free(&link_cache, link);
    --mpx->count;
 }
 
@@ -257,7 +274,7 @@ static void write_to_socket(multiplexor* mpx, udp_connection* link) {
 /* add a new connection to the double-linked linear
    list of connections */
 static bool add_connection(multiplexor* mpx) {
-   udp_connection* link = malloc(sizeof(udp_connection));
+   udp_connection* link = slab_alloc(&link_cache);
    if (link == 0) return false;
    *link = (udp_connection) {
       .fd = mpx->socket,
@@ -293,14 +310,23 @@ void run_udp_service(hostport* hp,
       udp_connection_handler input_handler,
       udp_connection_handler close_handler,
       void* global_handle) {
+   run_udp_service_with_profile(hp, 0, timeout, max_retries,
+      open_handler, input_handler, close_handler, global_handle);
+}
+
+void run_udp_service_with_profile(hostport* hp,
+      const socket_profile* profile,
+      int timeout, unsigned int max_retries,
+      udp_connection_handler open_handler,
+      udp_connection_handler input_handler,
+      udp_connection_handler close_handler,
+      void* global_handle) {
    assert(timeout > 0);
    if (!hp->type) {
       hp->type = SOCK_DGRAM;
    }
-   int sfd = socket(hp->domain, hp->type, hp->protocol);
-   if (sfd < 0 || bind(sfd, (struct sockaddr *) &hp->addr, hp->namelen) < 0) {
-      return;
-   }
+   int sfd = create_listener(hp, profile);
+   if (sfd < 0) return;
    multiplexor mpx = {
       .socket = sfd,
       .hp = *hp,
@@ -359,7 +385,7 @@ void run_udp_service(hostport* hp,
    the buffer is released as soon as it is sent & acknowledged */
 bool write_to_udp_link(udp_connection* link, void* buf, size_t len) {
    assert(len >= 0);
-   output_queue_member* member = malloc(sizeof(output_queue_member));
+   output_queue_member* member = slab_alloc(&member_cache);
    if (!member) return false;
    member->buf = buf; member->len = len;
    member->attempts = 0; member->timeouts = 0;
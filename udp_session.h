@@ -1,6 +1,6 @@
 /*
    Small library of useful utilities
-   Copyright (C) 2015 Andreas Franz Borchert
+   Copyright (C) 2015, 2026 Andreas Franz Borchert
    --------------------------------------------------------------------
    This library is free software; you can redistribute it and/or modify
    it under the terms of the GNU Library General Public License as
@@ -21,6 +21,7 @@
 
 #include <stdbool.h>
 #include <afblib/hostport.h>
+#include <afblib/listener.h>
 
 typedef struct udp_connection {
    int fd;
@@ -44,6 +45,13 @@ void run_udp_service(hostport* hp,
    udp_connection_handler input_handler,
    udp_connection_handler close_handler,
    void* global_handle);
+void run_udp_service_with_profile(hostport* hp,
+   const socket_profile* profile,
+   int timeout, unsigned int max_retries,
+   udp_connection_handler open_handler,
+   udp_connection_handler input_handler,
+   udp_connection_handler close_handler,
+   void* global_handle);
 bool write_to_udp_link(udp_connection* link, void* buf, size_t len);
 ssize_t read_from_udp_link(udp_connection* link, void* buf, size_t len);
 void close_udp_link(udp_connection* link);